@@ -0,0 +1,56 @@
+/* ---------------------------------------------------------------------------
+ *  common
+ * ---------------------------------------------------------------------------
+ *  Name: backoff.h
+ * --------------------------------------------------------------------------*/
+#ifndef BACKOFF_H_
+#define BACKOFF_H_
+
+#include <stdint.h>
+
+/* Retry policy shared by reconnect loops. Delay ceiling doubles with every
+ * failed attempt up to max_ms and the actual delay is drawn uniformly from
+ * [0, ceiling] (full jitter), so devices restarted together spread out. One
+ * instance belongs to one loop, it is not thread safe. */
+typedef struct backoff {
+    const char *name;
+    uint32_t base_ms;
+    uint32_t max_ms;
+    uint32_t attempts;       /* failed attempts since last success */
+    uint32_t total_attempts; /* failed attempts since boot */
+    int64_t started_ms;      /* uptime of first failure in current streak */
+    int64_t reconnect_ms;    /* time spent in failure streaks since boot */
+} backoff_t;
+
+#define BACKOFF_INITIALIZER(_name, _base_ms, _max_ms)                          \
+    {                                                                          \
+        .name = (_name), .base_ms = (_base_ms), .max_ms = (_max_ms),           \
+    }
+
+/**
+ * @brief Record failed attempt.
+ * @return Delay in miliseconds before the next attempt.
+ */
+uint32_t backoff_next(backoff_t *backoff);
+
+/**
+ * @brief Record success, next failure starts again from base_ms.
+ */
+void backoff_reset(backoff_t *backoff);
+
+/**
+ * @brief Failed attempts since boot.
+ */
+uint32_t backoff_total_attempts(const backoff_t *backoff);
+
+/**
+ * @brief Time from first failure to success summed over finished failure
+ * streaks since boot.
+ * @return Miliseconds.
+ */
+int64_t backoff_recovery_ms(const backoff_t *backoff);
+
+#endif /* BACKOFF_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,61 @@
+/* ---------------------------------------------------------------------------
+ *  common
+ * ---------------------------------------------------------------------------
+ *  Name: dhcp_lease.h
+ * --------------------------------------------------------------------------*/
+#ifndef DHCP_LEASE_H_
+#define DHCP_LEASE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/net/net_if.h>
+
+/* Time powered off is unknown after reboot, so a lease restored from flash
+ * is applied only when it was granted for at least this long */
+#define DHCP_LEASE_MIN_TIME (3600) /* seconds */
+
+/* Applied address is removed when DHCP does not bind within this time, or
+ * when the remaining lease is shorter, within the remaining lease */
+#define DHCP_LEASE_CONFIRM_TIME (30) /* seconds */
+
+/**
+ * @brief Called from system work queue when applied address was removed
+ * because DHCP did not confirm it in time.
+ */
+typedef void (*dhcp_lease_expired_cb_t)(struct net_if *iface);
+
+/**
+ * @brief Restore lease saved by dhcp_lease_bound() in previous boot. Lease is
+ * used by one thread only, e.g. net_mgmt callbacks, it is not thread safe.
+ * @param fs Storage for persistent copy, NULL to keep lease in RAM only
+ * @param expired_cb Notified when applied address is removed, may be NULL
+ * @return true when a lease was restored.
+ */
+bool dhcp_lease_init(struct nvs_fs *fs, dhcp_lease_expired_cb_t expired_cb);
+
+/**
+ * @brief Configure address, netmask and gateway of the last lease on iface,
+ * so sockets work right after association instead of after DHCP exchange.
+ * Address is added as DHCP one with lifetime of the remaining lease, or of
+ * DHCP_LEASE_CONFIRM_TIME for a lease from previous boot whose remaining
+ * time is unknown. DHCP keeps running meanwhile and dhcp_lease_bound()
+ * confirms the address, without it the address is removed after
+ * DHCP_LEASE_CONFIRM_TIME. Address kept by iface over link loss is left as
+ * it is.
+ * @return true when iface has a usable address, false when lease expired.
+ */
+bool dhcp_lease_apply(struct net_if *iface);
+
+/**
+ * @brief Save lease on NET_EVENT_IPV4_DHCP_BOUND and drop the applied address
+ * when server gave another one.
+ * @return true when applied address was dropped, connections made with it
+ * must be opened again.
+ */
+bool dhcp_lease_bound(struct net_if *iface);
+
+#endif /* DHCP_LEASE_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,41 @@
+/* ---------------------------------------------------------------------------
+ *  storage
+ * ---------------------------------------------------------------------------
+ *  Name: nvs_storage.h
+ * --------------------------------------------------------------------------*/
+#ifndef NVS_STORAGE_H_
+#define NVS_STORAGE_H_
+
+#include <stdint.h>
+#include <zephyr/fs/nvs.h>
+
+/* NVS ids used by modules of all samples, keep ranges separated */
+#define NVS_STORAGE_ID_MQTT_STORE_META   (0x0010)
+#define NVS_STORAGE_ID_DNS_CACHE         (0x0011)
+#define NVS_STORAGE_ID_MQTT_SESSION_META (0x0012)
+#define NVS_STORAGE_ID_WIFI_LAST_AP      (0x0013) /* shared by instances */
+#define NVS_STORAGE_ID_DHCP_LEASE        (0x0014) /* shared by instances */
+#define NVS_STORAGE_ID_MQTT_STORE_BASE   (0x0100) /* up to 0x01FF */
+#define NVS_STORAGE_ID_MQTT_SESSION_BASE (0x0200) /* up to 0x02FF */
+
+/* Ids above are of the first mqtt worker, next ones add index * STRIDE */
+#define NVS_STORAGE_ID_INSTANCE_STRIDE (0x1000)
+
+/**
+ * @brief Mount NVS on storage_partition. Call once at startup, before any
+ * module which keeps data in flash is initialized.
+ * @return 0 on success, negative value on error.
+ */
+int32_t nvs_storage_init(void);
+
+/**
+ * @brief Get mounted file system.
+ * @return Pointer to nvs_fs, NULL if nvs_storage_init() failed or was not
+ * called.
+ */
+struct nvs_fs *nvs_storage_get(void);
+
+#endif /* NVS_STORAGE_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
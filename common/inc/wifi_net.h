@@ -0,0 +1,57 @@
+/* ---------------------------------------------------------------------------
+ *  wifi
+ * ---------------------------------------------------------------------------
+ *  Name: wifi_net.h
+ * --------------------------------------------------------------------------*/
+#ifndef WIFI_NET_H_
+#define WIFI_NET_H_
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+#define WIFI_NET_MAX_LISTENERS (4)
+
+/* Connectivity changes, in the order they usually come */
+typedef enum wifi_net_event {
+    WIFI_NET_LINK_UP,   /* associated with access point */
+    WIFI_NET_IP_READY,  /* IPv4 address usable, from cached lease or DHCP */
+    WIFI_NET_IP_LOST,   /* address dropped, sockets bound to it are dead */
+    WIFI_NET_LINK_DOWN, /* association lost, reconnect is scheduled */
+} wifi_net_event_t;
+
+typedef void (*wifi_net_cb_t)(wifi_net_event_t event, void *user_data);
+
+/**
+ * @brief Register consumer of connectivity changes, e.g. MQTT or SNTP. Every
+ * change is given to all listeners at once, in order of registration, from
+ * net_mgmt event thread, so callbacks must not block. Register before
+ * wifi_net_init() to get every event.
+ * @return 0 on success, -ENOMEM when WIFI_NET_MAX_LISTENERS are registered.
+ */
+int32_t wifi_net_listener_add(wifi_net_cb_t cb, void *user_data);
+
+/**
+ * @brief Start connecting to access point and reconnect with backoff
+ * whenever link is lost. Returns right away, see wifi_net_wait_ready().
+ * Mount nvs_storage before, to keep access point and DHCP lease in flash.
+ */
+void wifi_net_init(char *ssid, char *passwd);
+
+/**
+ * @brief Wait until IPv4 address is usable, for code which has nothing to
+ * do before, e.g. main thread of a sample.
+ * @return 0 when ready, -EAGAIN on timeout.
+ */
+int32_t wifi_net_wait_ready(k_timeout_t timeout);
+
+/**
+ * @brief DTIM interval of current access point. With power save the station
+ * wakes for every DTIM beacon anyway, other wakeups are best aligned to it.
+ * @return Milliseconds, 0 when not associated or not reported by driver.
+ */
+uint32_t wifi_net_dtim_ms(void);
+
+#endif /* WIFI_NET_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,63 @@
+/* ---------------------------------------------------------------------------
+ *  common
+ * ---------------------------------------------------------------------------
+ *  Name: backoff.c
+ * --------------------------------------------------------------------------*/
+#include "backoff.h"
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/random/random.h>
+
+LOG_MODULE_REGISTER(BACKOFF, LOG_LEVEL_DBG);
+
+uint32_t backoff_next(backoff_t *backoff) {
+    uint64_t ceiling = backoff->base_ms;
+
+    if (0 == backoff->attempts) {
+        backoff->started_ms = k_uptime_get();
+    }
+
+    for (uint32_t i = 0; i < backoff->attempts && ceiling < backoff->max_ms;
+         i++) {
+        ceiling *= 2;
+    }
+    ceiling = MIN(ceiling, backoff->max_ms);
+
+    backoff->attempts++;
+    backoff->total_attempts++;
+
+    uint32_t delay = sys_rand32_get() % ((uint32_t)ceiling + 1);
+    LOG_INF("%s: attempt %u failed, retry in %u ms", backoff->name,
+            backoff->attempts, delay);
+
+    return (delay);
+}
+
+void backoff_reset(backoff_t *backoff) {
+    if (0 == backoff->attempts) {
+        return;
+    }
+
+    int64_t streak_ms = k_uptime_get() - backoff->started_ms;
+    backoff->reconnect_ms += streak_ms;
+
+    LOG_INF("%s: recovered after %u attempts, %lld ms (total %u, %lld ms)",
+            backoff->name, backoff->attempts, streak_ms,
+            backoff->total_attempts, backoff->reconnect_ms);
+
+    backoff->attempts = 0;
+}
+
+uint32_t backoff_total_attempts(const backoff_t *backoff) {
+    return (backoff->total_attempts);
+}
+
+int64_t backoff_recovery_ms(const backoff_t *backoff) {
+    return (backoff->reconnect_ms);
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,172 @@
+/* ---------------------------------------------------------------------------
+ *  common
+ * ---------------------------------------------------------------------------
+ *  Name: dhcp_lease.c
+ * --------------------------------------------------------------------------*/
+#include "dhcp_lease.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/net_ip.h>
+
+#include "nvs_storage.h"
+
+LOG_MODULE_REGISTER(DHCP_LEASE, LOG_LEVEL_DBG);
+
+static uint32_t lease_remaining(void);
+static bool iface_has_addr(struct net_if *iface);
+static void confirm_work_handler(struct k_work *work);
+
+K_WORK_DELAYABLE_DEFINE(ConfirmWork, confirm_work_handler);
+
+static struct nvs_fs *Fs = NULL;
+static dhcp_lease_expired_cb_t ExpiredCb = NULL;
+static struct net_if *AppliedIface = NULL;
+
+/* Same layout in RAM and in flash, DNS servers are not kept, samples use
+ * fixed ones from CONFIG_DNS_SERVER1 */
+static struct {
+    struct in_addr addr;
+    struct in_addr netmask;
+    struct in_addr gw;
+    uint32_t lease_time; /* seconds */
+} Lease = {0};
+static int64_t ExpiryMs = 0; /* 0 when lease was granted in previous boot */
+static bool Applied = false; /* address configured by dhcp_lease_apply() */
+
+bool dhcp_lease_init(struct nvs_fs *fs, dhcp_lease_expired_cb_t expired_cb) {
+    char buf[NET_IPV4_ADDR_LEN];
+
+    Fs = fs;
+    ExpiredCb = expired_cb;
+    memset(&Lease, 0, sizeof(Lease));
+    ExpiryMs = 0;
+    Applied = false;
+
+    if (NULL != Fs) {
+        ssize_t rc =
+            nvs_read(Fs, NVS_STORAGE_ID_DHCP_LEASE, &Lease, sizeof(Lease));
+        if (sizeof(Lease) != rc) {
+            memset(&Lease, 0, sizeof(Lease));
+        }
+    }
+
+    if (0 == Lease.addr.s_addr) {
+        return (false);
+    }
+
+    LOG_INF("Lease of %s for %u s restored",
+            net_addr_ntop(AF_INET, &Lease.addr, buf, sizeof(buf)),
+            Lease.lease_time);
+    return (true);
+}
+
+bool dhcp_lease_apply(struct net_if *iface) {
+    char buf[NET_IPV4_ADDR_LEN];
+    uint32_t remaining = lease_remaining();
+
+    if (0 == remaining) {
+        return (false);
+    }
+    if (iface_has_addr(iface)) {
+        /* kept over link loss, DHCP renews it */
+        return (true);
+    }
+
+    if (NULL ==
+        net_if_ipv4_addr_add(iface, &Lease.addr, NET_ADDR_DHCP, remaining)) {
+        LOG_ERR("Failed to add cached address");
+        return (false);
+    }
+    net_if_ipv4_set_netmask(iface, &Lease.netmask);
+    net_if_ipv4_set_gw(iface, &Lease.gw);
+    Applied = true;
+    AppliedIface = iface;
+    k_work_reschedule(&ConfirmWork,
+                      K_SECONDS(MIN(remaining, DHCP_LEASE_CONFIRM_TIME)));
+
+    LOG_INF("Using cached address %s, %u s left, until DHCP confirms it",
+            net_addr_ntop(AF_INET, &Lease.addr, buf, sizeof(buf)), remaining);
+    return (true);
+}
+
+bool dhcp_lease_bound(struct net_if *iface) {
+    const struct net_if_dhcpv4 *dhcpv4 = &iface->config.dhcpv4;
+    char buf[NET_IPV4_ADDR_LEN];
+    bool dropped = false;
+
+    k_work_cancel_delayable(&ConfirmWork);
+    if (Applied && !net_ipv4_addr_cmp(&Lease.addr, &dhcpv4->requested_ip)) {
+        LOG_WRN("Cached address %s not confirmed, dropped",
+                net_addr_ntop(AF_INET, &Lease.addr, buf, sizeof(buf)));
+        net_if_ipv4_addr_rm(iface, &Lease.addr);
+        dropped = true;
+    }
+    Applied = false;
+
+    Lease.addr = dhcpv4->requested_ip;
+    Lease.netmask = iface->config.ip.ipv4->netmask;
+    Lease.gw = iface->config.ip.ipv4->gw;
+    Lease.lease_time = dhcpv4->lease_time;
+    ExpiryMs = k_uptime_get() + (int64_t)Lease.lease_time * MSEC_PER_SEC;
+
+    if (NULL != Fs) {
+        /* nvs skips the write when stored record is the same */
+        ssize_t rc =
+            nvs_write(Fs, NVS_STORAGE_ID_DHCP_LEASE, &Lease, sizeof(Lease));
+        if (0 > rc) {
+            LOG_ERR("Failed to save lease, err %d", (int32_t)rc);
+        }
+    }
+
+    return (dropped);
+}
+
+/* Seconds of the lease left, 0 when expired or not usable */
+static uint32_t lease_remaining(void) {
+    if (0 == Lease.addr.s_addr) {
+        return (0);
+    }
+    if (0 != ExpiryMs) {
+        int64_t left_ms = ExpiryMs - k_uptime_get();
+        return ((0 < left_ms) ? (uint32_t)(left_ms / MSEC_PER_SEC) : 0);
+    }
+    /* granted in previous boot, time since then is unknown, so only the
+     * confirmation time is vouched for */
+    return ((DHCP_LEASE_MIN_TIME <= Lease.lease_time) ? DHCP_LEASE_CONFIRM_TIME
+                                                      : 0);
+}
+
+static bool iface_has_addr(struct net_if *iface) {
+    for (int32_t i = 0; i < NET_IF_MAX_IPV4_ADDR; i++) {
+        if (iface->config.ip.ipv4->unicast[i].is_used) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+/* DHCP did not bind in time, the server may have given the address to
+ * another host meanwhile */
+static void confirm_work_handler(struct k_work *work) {
+    char buf[NET_IPV4_ADDR_LEN];
+
+    if (!Applied) {
+        return;
+    }
+
+    LOG_WRN("Cached address %s not confirmed in time, removed",
+            net_addr_ntop(AF_INET, &Lease.addr, buf, sizeof(buf)));
+    net_if_ipv4_addr_rm(AppliedIface, &Lease.addr);
+    Applied = false;
+    if (NULL != ExpiredCb) {
+        ExpiredCb(AppliedIface);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,68 @@
+/* ---------------------------------------------------------------------------
+ *  storage
+ * ---------------------------------------------------------------------------
+ *  Name: nvs_storage.c
+ * --------------------------------------------------------------------------*/
+#include "nvs_storage.h"
+
+#include <stdbool.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+
+LOG_MODULE_REGISTER(NVS_STORAGE, LOG_LEVEL_DBG);
+
+#define NVS_PARTITION        storage_partition
+#define NVS_PARTITION_DEVICE FIXED_PARTITION_DEVICE(NVS_PARTITION)
+#define NVS_PARTITION_OFFSET FIXED_PARTITION_OFFSET(NVS_PARTITION)
+#define NVS_PARTITION_SIZE   FIXED_PARTITION_SIZE(NVS_PARTITION)
+
+static struct nvs_fs Fs = {0};
+static bool Mounted = false;
+
+int32_t nvs_storage_init(void) {
+    int32_t rc = 0;
+    struct flash_pages_info info = {0};
+
+    if (Mounted) {
+        goto init_done;
+    }
+
+    Fs.flash_device = NVS_PARTITION_DEVICE;
+    if (!device_is_ready(Fs.flash_device)) {
+        LOG_ERR("Flash device %s is not ready", Fs.flash_device->name);
+        rc = -ENODEV;
+        goto init_done;
+    }
+
+    Fs.offset = NVS_PARTITION_OFFSET;
+    rc = flash_get_page_info_by_offs(Fs.flash_device, Fs.offset, &info);
+    if (rc) {
+        LOG_ERR("Unable to get page info");
+        goto init_done;
+    }
+    LOG_INF("NVS sector size %u part size %u", info.size, NVS_PARTITION_SIZE);
+
+    Fs.sector_size = info.size;
+    Fs.sector_count = NVS_PARTITION_SIZE / info.size;
+
+    rc = nvs_mount(&Fs);
+    if (rc) {
+        LOG_ERR("Flash Init failed, err %d", rc);
+        goto init_done;
+    }
+    Mounted = true;
+
+init_done:
+    return (rc);
+}
+
+struct nvs_fs *nvs_storage_get(void) {
+    return (Mounted ? &Fs : NULL);
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,394 @@
+/* ---------------------------------------------------------------------------
+ *  wifi
+ * ---------------------------------------------------------------------------
+ *  Name: wifi_net.c
+ * --------------------------------------------------------------------------*/
+#include "wifi_net.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/net_event.h>
+#include <zephyr/net/net_if.h>
+#include <zephyr/net/wifi_mgmt.h>
+
+#include "backoff.h"
+#include "dhcp_lease.h"
+#include "nvs_storage.h"
+
+LOG_MODULE_REGISTER(WIFI, LOG_LEVEL_DBG);
+
+#define WIFI_NET_IP_READY_BIT BIT(0)
+
+static K_EVENT_DEFINE(NetState);
+
+static struct net_mgmt_event_callback wifi_cb;
+static struct net_mgmt_event_callback ipv4_cb;
+
+static void handle_wifi_connect_result(struct net_mgmt_event_callback *cb);
+static void handle_wifi_disconnect_result(struct net_mgmt_event_callback *cb);
+static void handle_ipv4_result(struct net_if *iface);
+static void handle_dhcp_bound(struct net_if *iface);
+static void handle_lease_expired(struct net_if *iface);
+static void wifi_mgmt_event_handler(struct net_mgmt_event_callback *cb,
+                                    uint32_t mgmt_event, struct net_if *iface);
+static void wifi_status(void);
+static void power_save_set(void);
+static void notify(wifi_net_event_t event);
+static void ip_ready(void);
+static void ip_lost(void);
+static void connect_request(void);
+static void last_ap_load(void);
+static void last_ap_save(const struct wifi_iface_status *status);
+static void reconnect_work_handler(struct k_work *work);
+static void reconnect_timer_handler(struct k_timer *dummy);
+
+K_WORK_DEFINE(ReconnectWork, reconnect_work_handler);
+K_TIMER_DEFINE(ReconnectTimer, reconnect_timer_handler, NULL);
+
+static struct wifi_connect_req_params WifiInit = {0};
+static backoff_t ReconnectBackoff = BACKOFF_INITIALIZER("wifi", 1000, 60000);
+
+/* Access point of the last successful connect, same layout in RAM and in
+ * flash. Channel 0 means none, connect scans all channels. */
+static struct {
+    char ssid[WIFI_SSID_MAX_LEN];
+    uint8_t bssid[WIFI_MAC_ADDR_LEN];
+    uint8_t channel;
+} LastAp = {0};
+static bool DirectedConnect = false; /* last request used LastAp */
+static int64_t LinkDownMs = 0; /* uptime of link loss, -1 once DHCP bound */
+static bool LinkUp = false;
+static bool IpReady = false;
+static uint32_t DtimMs = 0;
+
+static struct {
+    wifi_net_cb_t cb;
+    void *user_data;
+} Listeners[WIFI_NET_MAX_LISTENERS];
+static int32_t ListenersCnt = 0;
+
+int32_t wifi_net_listener_add(wifi_net_cb_t cb, void *user_data) {
+    if (WIFI_NET_MAX_LISTENERS <= ListenersCnt) {
+        LOG_ERR("Too many listeners");
+        return (-ENOMEM);
+    }
+
+    Listeners[ListenersCnt].cb = cb;
+    Listeners[ListenersCnt].user_data = user_data;
+    ListenersCnt++;
+    return (0);
+}
+
+int32_t wifi_net_wait_ready(k_timeout_t timeout) {
+    if (0 == k_event_wait(&NetState, WIFI_NET_IP_READY_BIT, false, timeout)) {
+        return (-EAGAIN);
+    }
+    return (0);
+}
+
+uint32_t wifi_net_dtim_ms(void) {
+    return (LinkUp ? DtimMs : 0);
+}
+
+void wifi_net_init(char *ssid, char *passwd) {
+    net_mgmt_init_event_callback(
+        &wifi_cb, wifi_mgmt_event_handler,
+        NET_EVENT_WIFI_CONNECT_RESULT | NET_EVENT_WIFI_DISCONNECT_RESULT);
+
+    net_mgmt_init_event_callback(
+        &ipv4_cb, wifi_mgmt_event_handler,
+        NET_EVENT_IPV4_ADDR_ADD | NET_EVENT_IPV4_DHCP_BOUND);
+
+    net_mgmt_add_event_callback(&wifi_cb);
+    net_mgmt_add_event_callback(&ipv4_cb);
+
+    WifiInit.ssid = (const uint8_t *)ssid;
+    WifiInit.ssid_length = strlen(ssid);
+
+    if (NULL != passwd) {
+        WifiInit.security = WIFI_SECURITY_TYPE_PSK;
+        WifiInit.psk = (uint8_t *)passwd;
+        WifiInit.psk_length = strlen(passwd);
+    }
+
+    WifiInit.channel = WIFI_CHANNEL_ANY;
+    WifiInit.band = WIFI_FREQ_BAND_2_4_GHZ;
+    WifiInit.mfp = WIFI_MFP_OPTIONAL;
+
+    last_ap_load();
+    dhcp_lease_init(nvs_storage_get(), handle_lease_expired);
+    connect_request();
+}
+
+static void reconnect_timer_handler(struct k_timer *dummy) {
+    k_work_submit(&ReconnectWork);
+}
+
+static void reconnect_work_handler(struct k_work *work) {
+    LOG_INF("Make wifi connection attempt...");
+    connect_request();
+}
+
+static void connect_request(void) {
+    struct net_if *iface = net_if_get_default();
+    struct wifi_connect_req_params params = WifiInit;
+
+    /* directed connect probes one channel instead of scanning all of them,
+     * which is most of the association time */
+    DirectedConnect = (0 != LastAp.channel);
+    if (DirectedConnect) {
+        params.channel = LastAp.channel;
+#if defined(CONFIG_APP_WIFI_CONNECT_BSSID)
+        memcpy(params.bssid, LastAp.bssid, sizeof(params.bssid));
+#endif
+        LOG_INF("Connecting to SSID: %s, channel %u", WifiInit.ssid,
+                params.channel);
+    } else {
+        LOG_INF("Connecting to SSID: %s", WifiInit.ssid);
+    }
+
+    if (net_mgmt(NET_REQUEST_WIFI_CONNECT, iface, &params,
+                 sizeof(struct wifi_connect_req_params))) {
+        LOG_ERR("WiFi Connection Request Failed");
+    }
+}
+
+static void handle_wifi_connect_result(struct net_mgmt_event_callback *cb) {
+    const struct wifi_status *status = (const struct wifi_status *)cb->info;
+
+    if (status->status && DirectedConnect) {
+        /* access point moved or is gone, scan now, flash copy is replaced
+         * after the next successful connect */
+        LOG_INF("Connection on channel %u failed (%d), full scan",
+                LastAp.channel, status->status);
+        LastAp.channel = 0;
+        k_work_submit(&ReconnectWork);
+    } else if (status->status) {
+        LOG_INF("Connection request failed (%d)", status->status);
+        k_timer_start(&ReconnectTimer, K_MSEC(backoff_next(&ReconnectBackoff)),
+                      K_NO_WAIT);
+    } else {
+        LOG_INF("Connected");
+        backoff_reset(&ReconnectBackoff);
+        wifi_status();
+        power_save_set();
+        LinkUp = true;
+        notify(WIFI_NET_LINK_UP);
+        if (dhcp_lease_apply(net_if_get_default())) {
+            LOG_INF("IPv4 from cached lease %lld ms after boot or link loss",
+                    k_uptime_get() - LinkDownMs);
+            ip_ready();
+        }
+    }
+}
+
+static void handle_wifi_disconnect_result(struct net_mgmt_event_callback *cb) {
+    const struct wifi_status *status = (const struct wifi_status *)cb->info;
+
+    if (status->status) {
+        LOG_INF("Disconnection request (%d)", status->status);
+    } else {
+        LOG_INF("Disconnected");
+    }
+    if (0 > LinkDownMs) {
+        LinkDownMs = k_uptime_get();
+    }
+    if (IpReady) {
+        ip_lost();
+    }
+    if (LinkUp) {
+        LinkUp = false;
+        notify(WIFI_NET_LINK_DOWN);
+    }
+    /* one shot timer */
+    k_timer_start(&ReconnectTimer, K_MSEC(backoff_next(&ReconnectBackoff)),
+                  K_NO_WAIT);
+}
+
+static void handle_ipv4_result(struct net_if *iface) {
+    int32_t i = 0;
+
+    for (i = 0; i < NET_IF_MAX_IPV4_ADDR; i++) {
+        char buf[NET_IPV4_ADDR_LEN];
+
+        if (iface->config.ip.ipv4->unicast[i].addr_type != NET_ADDR_DHCP) {
+            continue;
+        }
+
+        LOG_INF("IPv4 address: %s",
+                net_addr_ntop(
+                    AF_INET, &iface->config.ip.ipv4->unicast[i].address.in_addr,
+                    buf, sizeof(buf)));
+        LOG_INF("Subnet: %s",
+                net_addr_ntop(AF_INET, &iface->config.ip.ipv4->netmask, buf,
+                              sizeof(buf)));
+        LOG_INF("Router: %s", net_addr_ntop(AF_INET, &iface->config.ip.ipv4->gw,
+                                            buf, sizeof(buf)));
+    }
+}
+
+static void handle_dhcp_bound(struct net_if *iface) {
+    if (dhcp_lease_bound(iface) && IpReady) {
+        /* server gave another address than the cached one */
+        ip_lost();
+    }
+    if (0 <= LinkDownMs) {
+        LOG_INF("IPv4 from DHCP %lld ms after boot or link loss",
+                k_uptime_get() - LinkDownMs);
+        LinkDownMs = -1;
+    }
+    /* renewals bind again, listeners hear only about changes */
+    if (!IpReady) {
+        ip_ready();
+    }
+}
+
+static void handle_lease_expired(struct net_if *iface) {
+    /* DHCP binds later with a fresh address and makes IP ready again */
+    if (IpReady) {
+        ip_lost();
+    }
+}
+
+static void ip_ready(void) {
+    IpReady = true;
+    k_event_post(&NetState, WIFI_NET_IP_READY_BIT);
+    notify(WIFI_NET_IP_READY);
+}
+
+static void ip_lost(void) {
+    IpReady = false;
+    k_event_set_masked(&NetState, 0, WIFI_NET_IP_READY_BIT);
+    notify(WIFI_NET_IP_LOST);
+}
+
+static void notify(wifi_net_event_t event) {
+    for (int32_t i = 0; i < ListenersCnt; i++) {
+        Listeners[i].cb(event, Listeners[i].user_data);
+    }
+}
+
+static void wifi_mgmt_event_handler(struct net_mgmt_event_callback *cb,
+                                    uint32_t mgmt_event, struct net_if *iface) {
+    switch (mgmt_event) {
+        case NET_EVENT_WIFI_CONNECT_RESULT: {
+            handle_wifi_connect_result(cb);
+            break;
+        }
+        case NET_EVENT_WIFI_DISCONNECT_RESULT: {
+            handle_wifi_disconnect_result(cb);
+            break;
+        }
+        case NET_EVENT_IPV4_ADDR_ADD: {
+            handle_ipv4_result(iface);
+            break;
+        }
+        case NET_EVENT_IPV4_DHCP_BOUND: {
+            handle_dhcp_bound(iface);
+            break;
+        }
+        default: {
+            LOG_ERR("Unknown mgmt_event event: %d", mgmt_event);
+            break;
+        }
+    }
+}
+
+static void wifi_status(void) {
+    struct net_if *iface = net_if_get_default();
+
+    struct wifi_iface_status status = {0};
+
+    if (net_mgmt(NET_REQUEST_WIFI_IFACE_STATUS, iface, &status,
+                 sizeof(struct wifi_iface_status))) {
+        LOG_INF("WiFi Status Request Failed\n");
+    }
+
+    if (status.state >= WIFI_STATE_ASSOCIATED) {
+        LOG_INF("SSID: %-32s", status.ssid);
+        LOG_INF("Band: %s", wifi_band_txt(status.band));
+        LOG_INF("Channel: %d", status.channel);
+        LOG_INF("Security: %s", wifi_security_txt(status.security));
+        LOG_INF("RSSI: %d", status.rssi);
+        /* beacon interval is in TU of 1024 us */
+        DtimMs = status.dtim_period * status.beacon_interval * 1024 / 1000;
+        LOG_INF("DTIM: %u ms", DtimMs);
+        last_ap_save(&status);
+    }
+}
+
+/* Station sleeps between beacons and wakes for DTIM to fetch frames the
+ * access point buffered meanwhile, set on every connect as drivers may reset
+ * it with the association */
+static void power_save_set(void) {
+#if defined(CONFIG_APP_WIFI_POWER_SAVE)
+    struct net_if *iface = net_if_get_default();
+    struct wifi_ps_params params = {0};
+
+    params.type = WIFI_PS_PARAM_WAKEUP_MODE;
+    params.wakeup_mode = WIFI_PS_WAKEUP_MODE_DTIM;
+    if (net_mgmt(NET_REQUEST_WIFI_PS, iface, &params, sizeof(params))) {
+        LOG_WRN("Power save wakeup mode not set, reason %d",
+                params.fail_reason);
+    }
+
+    params.type = WIFI_PS_PARAM_STATE;
+    params.enabled = WIFI_PS_ENABLED;
+    if (net_mgmt(NET_REQUEST_WIFI_PS, iface, &params, sizeof(params))) {
+        LOG_WRN("Power save not enabled, reason %d", params.fail_reason);
+        return;
+    }
+    LOG_INF("Power save: %s", wifi_ps_txt(params.enabled));
+#endif
+}
+
+static void last_ap_load(void) {
+    struct nvs_fs *fs = nvs_storage_get();
+
+    if (NULL != fs) {
+        ssize_t rc = nvs_read(fs, NVS_STORAGE_ID_WIFI_LAST_AP, &LastAp,
+                              sizeof(LastAp));
+        if (sizeof(LastAp) != rc || WIFI_CHANNEL_ANY == LastAp.channel ||
+            WifiInit.ssid_length > sizeof(LastAp.ssid) ||
+            0 != strncmp(LastAp.ssid, (const char *)WifiInit.ssid,
+                         sizeof(LastAp.ssid))) {
+            memset(&LastAp, 0, sizeof(LastAp));
+        }
+    }
+
+    if (0 != LastAp.channel) {
+        LOG_INF("Last access point %02x:%02x:%02x:%02x:%02x:%02x, channel %u",
+                LastAp.bssid[0], LastAp.bssid[1], LastAp.bssid[2],
+                LastAp.bssid[3], LastAp.bssid[4], LastAp.bssid[5],
+                LastAp.channel);
+    }
+}
+
+static void last_ap_save(const struct wifi_iface_status *status) {
+    struct nvs_fs *fs = nvs_storage_get();
+
+    if (0 == status->channel || WIFI_CHANNEL_ANY <= status->channel) {
+        return;
+    }
+
+    memset(&LastAp, 0, sizeof(LastAp));
+    memcpy(LastAp.ssid, status->ssid,
+           MIN(status->ssid_len, sizeof(LastAp.ssid)));
+    memcpy(LastAp.bssid, status->bssid, sizeof(LastAp.bssid));
+    LastAp.channel = (uint8_t)status->channel;
+
+    if (NULL != fs) {
+        /* nvs skips the write when stored record is the same */
+        ssize_t rc = nvs_write(fs, NVS_STORAGE_ID_WIFI_LAST_AP, &LastAp,
+                               sizeof(LastAp));
+        if (0 > rc) {
+            LOG_ERR("Failed to save access point, err %d", (int32_t)rc);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
\ No newline at end of file
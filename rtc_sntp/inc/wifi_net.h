@@ -1,14 +0,0 @@
-/* ---------------------------------------------------------------------------
- *  wifi
- * ---------------------------------------------------------------------------
- *  Name: wifi_net.h
- * --------------------------------------------------------------------------*/
-#ifndef WIFI_NET_H_
-#define WIFI_NET_H_
-
-void wifi_net_init(char *ssid, char *passwd);
-
-#endif /* WIFI_NET_H_ */
-/* ---------------------------------------------------------------------------
- * end of file
- * --------------------------------------------------------------------------*/
\ No newline at end of file
@@ -12,6 +12,8 @@
 #include <zephyr/net/net_event.h>
 #include <zephyr/net/sntp.h>
 
+#include "backoff.h"
+#include "nvs_storage.h"
 #include "wifi_net.h"
 #include "config_wifi.h"
 
@@ -22,6 +24,15 @@ static const struct gpio_dt_spec InfoLed =
 
 static int64_t UptimeSyncMs = 0;
 static int64_t SntpSyncSec = 0;
+static backoff_t SntpBackoff = BACKOFF_INITIALIZER("sntp", 1000, 60000);
+static K_SEM_DEFINE(SyncRequest, 0, 1);
+
+static void net_event_cb(wifi_net_event_t event, void *user_data) {
+    if (WIFI_NET_IP_READY == event) {
+        /* clock drifted while offline, sync right away */
+        k_sem_give(&SyncRequest);
+    }
+}
 
 static int64_t rtc_time_get(void) {
     int64_t sec_elapsed = (k_uptime_get() - UptimeSyncMs) / 1000;
@@ -58,22 +69,31 @@ int main(void) {
         return (0);
     }
 
+    ret = nvs_storage_init();
+    if (0 != ret) {
+        LOG_WRN("Storage not available, err %d", ret);
+    }
+
     /* Wait till wifi connection established */
+    wifi_net_listener_add(net_event_cb, NULL);
     wifi_net_init(WIFI_SSID, WIFI_PASS);
+    wifi_net_wait_ready(K_FOREVER);
 
     int32_t rtc_first_sync_rc = rtc_time_sync();
     while (0 != rtc_first_sync_rc) {
+        k_sleep(K_MSEC(backoff_next(&SntpBackoff)));
         rtc_first_sync_rc = rtc_time_sync();
-        k_sleep(K_SECONDS(4));
     }
+    backoff_reset(&SntpBackoff);
+    k_sem_reset(&SyncRequest);
 
     int64_t last_sync_uptime = k_uptime_get();
     while (1) {
-        k_sleep(K_SECONDS(1));
+        bool sync_now = (0 == k_sem_take(&SyncRequest, K_SECONDS(1)));
         gpio_pin_toggle_dt(&InfoLed);
 
         int64_t uptime_now = k_uptime_get();
-        if (60 * 1000 < uptime_now - last_sync_uptime) {
+        if (sync_now || 60 * 1000 < uptime_now - last_sync_uptime) {
             time_t now = rtc_time_get();
             struct tm now_tm;
             gmtime_r(&now, &now_tm);
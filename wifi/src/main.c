@@ -9,6 +9,7 @@
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
+#include "nvs_storage.h"
 #include "wifi_net.h"
 #include "config_wifi.h"
 
@@ -32,7 +33,14 @@ int main(void) {
         return (0);
     }
 
+    ret = nvs_storage_init();
+    if (0 != ret) {
+        LOG_WRN("Storage not available, err %d", ret);
+    }
+
     wifi_net_init(WIFI_SSID, WIFI_PASS);
+    wifi_net_wait_ready(K_FOREVER);
+    LOG_INF("Ready...");
 
     while (1) {
         k_sleep(K_SECONDS(1));
@@ -0,0 +1,20 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: bench.h
+ * --------------------------------------------------------------------------*/
+#ifndef BENCH_H_
+#define BENCH_H_
+
+/**
+ * @brief Connect to CONFIG_APP_BENCH_BROKER and measure publish throughput,
+ * publish to PUBACK latency and publish to subscription callback latency for
+ * several payload sizes. Results are printed with printk, so they are not
+ * affected by log level. Network must be brought up by the caller.
+ */
+void bench_run(void);
+
+#endif /* BENCH_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
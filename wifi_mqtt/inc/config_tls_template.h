@@ -0,0 +1,21 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: config_tls.h
+ * --------------------------------------------------------------------------*/
+#ifndef CONFIG_TLS_H_
+#define CONFIG_TLS_H_
+
+#define TLS_BROKER_HOST "192.168.0.10"
+#define TLS_BROKER_PORT (8883)
+
+/* PEM of the CA which signed the broker certificate */
+#define TLS_CA_CERT                                                            \
+    "-----BEGIN CERTIFICATE-----\n"                                            \
+    "...\n"                                                                    \
+    "-----END CERTIFICATE-----\n"
+
+#endif /* CONFIG_TLS_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,72 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: dns_cache.h
+ * --------------------------------------------------------------------------*/
+#ifndef DNS_CACHE_H_
+#define DNS_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/net/net_ip.h>
+#include <zephyr/net/socket.h>
+
+#define DNS_CACHE_MAX_ADDRS    (4)
+#define DNS_CACHE_MAX_HOST_LEN (32)
+/* Resolver does not report record TTL, so every lookup is kept this long */
+#define DNS_CACHE_TTL (3600) /* seconds */
+
+/* Addresses of one hostname, fields are internal */
+typedef struct dns_cache {
+    struct nvs_fs *fs;
+    uint16_t id_offset; /* added to NVS id, separates instances */
+    struct { /* same layout in RAM and in flash */
+        char host[DNS_CACHE_MAX_HOST_LEN];
+        uint32_t count;
+        struct in_addr addrs[DNS_CACHE_MAX_ADDRS];
+    } record;
+    int64_t expiry_ms;
+    uint32_t first; /* index of last confirmed address */
+    uint32_t tried; /* addresses given since lookup or confirm */
+} dns_cache_t;
+
+/**
+ * @brief Bind cache to broker hostname and restore addresses saved in flash
+ * for the same hostname. Restored addresses are expired, dns_cache_next()
+ * gives them only as stale ones until the first lookup. Cache is used only by
+ * its mqtt worker thread, it is not thread safe.
+ * @param fs Storage for persistent copy, NULL to keep cache in RAM only
+ * @param id_offset Added to NVS id of persistent copy
+ * @param hostname Broker hostname
+ */
+void dns_cache_init(dns_cache_t *cache, struct nvs_fs *fs, uint16_t id_offset,
+                    const char *hostname);
+
+/**
+ * @brief Replace cached addresses with all IPv4 results of a fresh lookup.
+ * @return Number of cached addresses.
+ */
+int32_t dns_cache_update(dns_cache_t *cache,
+                         const struct zsock_addrinfo *res);
+
+/**
+ * @brief Get next address, round-robin starting from the last confirmed one.
+ * Every address is given once per lookup, afterwards fresh lookup is needed.
+ * @param addr Output address, port is not touched
+ * @param stale Allow expired or already tried addresses, e.g. when lookup
+ * itself failed.
+ * @return 0 on success, -ENOENT when fresh lookup is needed.
+ */
+int32_t dns_cache_next(dns_cache_t *cache, struct in_addr *addr, bool stale);
+
+/**
+ * @brief Mark address returned by last dns_cache_next() as working, it is
+ * tried first on next reconnect.
+ */
+void dns_cache_confirm(dns_cache_t *cache);
+
+#endif /* DNS_CACHE_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
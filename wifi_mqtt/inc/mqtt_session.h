@@ -0,0 +1,126 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: mqtt_session.h
+ * --------------------------------------------------------------------------*/
+#ifndef MQTT_SESSION_H_
+#define MQTT_SESSION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/net/mqtt.h>
+
+#include "mqtt_worker.h"
+
+#define MQTT_SESSION_MAX_UNACKED (8)  /* tracked outgoing QoS1 messages */
+#define MQTT_SESSION_ID_BLOCK    (64) /* message ids reserved per flash write */
+#define MQTT_SESSION_CLIENT_ID_LEN (24)
+#define MQTT_SESSION_DATA_LEN                                                  \
+    (MQTT_WORKER_MAX_TOPIC_LEN + MQTT_WORKER_MAX_PUBLISH_LEN)
+/* Changed entries reach flash this long after the first change, or when
+ * the link drops, so messages acked in time never touch flash */
+#define MQTT_SESSION_FLUSH_PERIOD CONFIG_APP_MQTT_SESSION_FLUSH_PERIOD /* s */
+
+/* Unacked message, same layout in RAM and in flash */
+typedef struct mqtt_session_entry {
+    uint32_t seq; /* send order */
+    uint16_t message_id;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    uint8_t retain;
+    uint8_t data[MQTT_SESSION_DATA_LEN]; /* topic followed by payload */
+} mqtt_session_entry_t;
+
+/* Session of one worker instance, fields are internal */
+typedef struct mqtt_session {
+    struct nvs_fs *fs;
+    uint16_t id_offset; /* added to NVS ids, separates instances */
+    struct {
+        char client_id[MQTT_SESSION_CLIENT_ID_LEN];
+        uint16_t next_id; /* first id not reserved yet */
+    } meta;
+    uint16_t next_id;
+    uint16_t ids_left;
+    uint32_t next_seq;
+    uint32_t resend_seq; /* entries from resend_seq to resend_end are due */
+    uint32_t resend_end;
+    /* entry is free when its message_id is 0 */
+    mqtt_session_entry_t entries[MQTT_SESSION_MAX_UNACKED];
+    uint32_t in_flash; /* bit per entry, record exists in flash */
+    uint32_t dirty;    /* bit per entry, RAM differs from flash */
+    int64_t flush_at;  /* INT64_MAX when nothing is dirty */
+} mqtt_session_t;
+
+/**
+ * @brief Restore client id, message id counter and unacked messages. With
+ * MQTT_WORKER_PERSISTENT_SESSION client id is generated once from
+ * MQTT_WORKER_CLIENT_ID and kept in flash, so the broker finds the same
+ * session after reboot, otherwise it is MQTT_WORKER_CLIENT_ID itself.
+ * @param fs Storage, NULL keeps everything in RAM only, unacked messages are
+ * then sent again after reconnect but not after reboot
+ * @param id_offset Added to every NVS id used by this session
+ */
+void mqtt_session_init(mqtt_session_t *session, struct nvs_fs *fs,
+                       uint16_t id_offset);
+
+const char *mqtt_session_client_id(mqtt_session_t *session);
+
+/**
+ * @brief Next packet id, never 0 and never one of unacked messages. Counter
+ * is saved every MQTT_SESSION_ID_BLOCK ids so ids are not reused after reboot.
+ */
+uint16_t mqtt_session_message_id_next(mqtt_session_t *session);
+
+/**
+ * @brief Keep copy of outgoing QoS1 message in RAM until its PUBACK. When
+ * table is full the oldest message is dropped. Flash is written later by
+ * mqtt_session_flush().
+ * @return 0 on success, negative value on error.
+ */
+int32_t mqtt_session_track(mqtt_session_t *session, uint16_t message_id,
+                           const char *topic, uint16_t topic_len,
+                           const uint8_t *payload, uint16_t payload_len,
+                           bool retain);
+
+/**
+ * @brief Forget message acked by broker.
+ * @return true if message was tracked.
+ */
+bool mqtt_session_release(mqtt_session_t *session, uint16_t message_id);
+
+/**
+ * @brief Uptime when mqtt_session_flush() is due.
+ * @return INT64_MAX when flash is up to date.
+ */
+int64_t mqtt_session_flush_deadline(mqtt_session_t *session);
+
+/**
+ * @brief Write entries changed since last flush, delete released ones. Call
+ * when mqtt_session_flush_deadline() passed and when the link drops.
+ */
+void mqtt_session_flush(mqtt_session_t *session);
+
+/**
+ * @brief Mark all tracked messages to be sent again with DUP flag and
+ * original id, call right after reconnect. Messages tracked later are not
+ * part of it.
+ * @return Number of messages to send again.
+ */
+int32_t mqtt_session_resend_start(mqtt_session_t *session);
+
+/**
+ * @brief Copy next message marked by mqtt_session_resend_start(), in
+ * original send order. It stays tracked until its PUBACK.
+ * @param topic Buffer of MQTT_WORKER_MAX_TOPIC_LEN bytes
+ * @param payload Buffer of MQTT_WORKER_MAX_PUBLISH_LEN bytes
+ * @return Packet id of the message, 0 when none is left.
+ */
+uint16_t mqtt_session_resend_next(mqtt_session_t *session, char *topic,
+                                  uint16_t *topic_len, uint8_t *payload,
+                                  uint16_t *payload_len, bool *retain);
+
+#endif /* MQTT_SESSION_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
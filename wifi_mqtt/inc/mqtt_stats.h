@@ -0,0 +1,148 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: mqtt_stats.h
+ * --------------------------------------------------------------------------*/
+#ifndef MQTT_STATS_H_
+#define MQTT_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/sys/atomic.h>
+
+#include "payload_cbor.h"
+
+#define MQTT_STATS_MAX_STATES   (6)
+#define MQTT_STATS_STATE_KEY    (12) /* "t_" + state name + NUL */
+#define MQTT_STATS_HIST_BUCKETS (24) /* last one holds 8.4 s and above */
+#define MQTT_STATS_EXTRA_MAX    (6)  /* fields added to metrics message */
+#define MQTT_STATS_KEY_MAX      (5)  /* counter, latency and extra keys */
+
+/* Worst case CBOR size of a metrics message, map head of less than 24 pairs
+ * is one byte, a field is text head, key and int32 of up to 5 bytes */
+#define MQTT_STATS_FIELD_MAX(key_len) (1 + (key_len) + 5)
+#define MQTT_STATS_COUNTERS_LEN_MAX                                            \
+    (1 + (MQTT_STATS_COUNTERS + 4 + MQTT_STATS_EXTRA_MAX) *                    \
+             MQTT_STATS_FIELD_MAX(MQTT_STATS_KEY_MAX))
+#define MQTT_STATS_STATES_LEN_MAX                                              \
+    (1 + 2 * MQTT_STATS_MAX_STATES *                                           \
+             MQTT_STATS_FIELD_MAX(MQTT_STATS_STATE_KEY - 1))
+/* One receive latency histogram per dispatch thread, each has one writer */
+#define MQTT_STATS_DISPATCH_HISTS (CONFIG_APP_MQTT_DISPATCH_THREADS)
+
+/* Events counted by the worker, keys of the metrics message in brackets */
+typedef enum mqtt_stats_counter {
+    MQTT_STATS_PUBLISHED, /* (pub) PUBLISH packets sent */
+    MQTT_STATS_ACKED,     /* (ack) PUBACK with success */
+    MQTT_STATS_NACKED,    /* (nack) PUBACK with error or reason code */
+    MQTT_STATS_TIMEOUT,   /* (tmo) no PUBACK in time */
+    MQTT_STATS_STORED,    /* (stor) publish kept in flash while offline */
+    MQTT_STATS_RECEIVED,  /* (rx) messages passed to dispatch thread */
+    MQTT_STATS_DROPPED,   /* (drop) messages lost for memory or queue */
+    MQTT_STATS_LINK_LOST, /* (lost) established connection dropped */
+    MQTT_STATS_WAKEUPS,   /* (wake) network thread woken by timer or input */
+    MQTT_STATS_COUNTERS
+} mqtt_stats_counter_t;
+
+/* Metrics are sent as two messages, each fits a publish slot on its own */
+typedef enum mqtt_stats_part {
+    MQTT_STATS_PART_COUNTERS, /* counters, p50/p99 latencies, extra fields */
+    MQTT_STATS_PART_STATES,   /* time spent in and entries of worker states */
+} mqtt_stats_part_t;
+
+/* Samples in microseconds, bucket n counts samples below 2^n us and at least
+ * 2^(n-1) us, so relative resolution is the same for 1 ms and for 1 s */
+typedef struct mqtt_stats_hist {
+    uint32_t bucket[MQTT_STATS_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+} mqtt_stats_hist_t;
+
+typedef struct mqtt_stats {
+    atomic_t counter[MQTT_STATS_COUNTERS];
+
+    /* Updated by network thread only */
+    const char *const *state_names;
+    char state_keys[MQTT_STATS_MAX_STATES][2][MQTT_STATS_STATE_KEY];
+    int32_t state_cnt;
+    int32_t state;
+    int64_t state_since;
+    uint32_t state_enter[MQTT_STATS_MAX_STATES];
+    uint64_t state_ms[MQTT_STATS_MAX_STATES];
+
+    mqtt_stats_hist_t puback;   /* publish sent to PUBACK, network thread */
+    /* received to handler, indexed by dispatch thread, merged on read */
+    mqtt_stats_hist_t dispatch[MQTT_STATS_DISPATCH_HISTS];
+} mqtt_stats_t;
+
+/**
+ * @brief Clear stats and start accounting time of the first state.
+ * @param state_names Names of the worker states, not copied. Keys of the
+ * metrics message are made of them with "t_" (seconds spent) and "n_" (times
+ * entered) prefix, longer names are cut.
+ * @param state_cnt Number of states, up to MQTT_STATS_MAX_STATES
+ * @param state Initial state
+ */
+void mqtt_stats_init(mqtt_stats_t *stats, const char *const *state_names,
+                     int32_t state_cnt, int32_t state);
+
+static inline void mqtt_stats_inc(mqtt_stats_t *stats,
+                                  mqtt_stats_counter_t counter) {
+    atomic_inc(&stats->counter[counter]);
+}
+
+/**
+ * @brief Account time spent in previous state, nothing when state is the
+ * same. Must be called from one thread only.
+ */
+void mqtt_stats_state_set(mqtt_stats_t *stats, int32_t state);
+
+/**
+ * @brief Add latency sample, one writer per histogram.
+ * @param ticks Kernel ticks, e.g. difference of two k_uptime_ticks()
+ */
+void mqtt_stats_hist_add(mqtt_stats_hist_t *hist, int64_t ticks);
+
+/**
+ * @brief Add samples of src to dst, src may be updated meanwhile.
+ */
+void mqtt_stats_hist_merge(mqtt_stats_hist_t *dst,
+                           const mqtt_stats_hist_t *src);
+
+/**
+ * @brief Latency below which pct percent of samples are, as upper bound of
+ * the bucket, so it overestimates by less than factor of 2.
+ * @return Microseconds, 0 when histogram is empty.
+ */
+uint32_t mqtt_stats_hist_percentile(const mqtt_stats_hist_t *hist,
+                                    uint32_t pct);
+
+/**
+ * @brief Raise high-water mark, safe from any thread.
+ */
+void mqtt_stats_max_update(atomic_t *max, atomic_val_t value);
+
+/**
+ * @brief Encode one part of the stats as CBOR map, see payload_cbor_encode().
+ * Size is at most MQTT_STATS_COUNTERS_LEN_MAX or MQTT_STATS_STATES_LEN_MAX.
+ * @param extra Fields appended to the counters, up to MQTT_STATS_EXTRA_MAX
+ * integers with keys of up to MQTT_STATS_KEY_MAX characters
+ * @return Encoded length or negative error.
+ */
+int32_t mqtt_stats_encode(const mqtt_stats_t *stats, mqtt_stats_part_t part,
+                          const payload_field_t *extra, size_t extra_cnt,
+                          uint8_t *buf, size_t size);
+
+#if defined(CONFIG_SHELL)
+struct shell;
+
+/**
+ * @brief Print all stats including non-empty histogram buckets.
+ */
+void mqtt_stats_print(const mqtt_stats_t *stats, const struct shell *sh);
+#endif
+
+#endif /* MQTT_STATS_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
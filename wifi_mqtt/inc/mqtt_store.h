@@ -0,0 +1,88 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: mqtt_store.h
+ * --------------------------------------------------------------------------*/
+#ifndef MQTT_STORE_H_
+#define MQTT_STORE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/fs/nvs.h>
+
+#include "mqtt_worker.h"
+
+#define MQTT_STORE_CAPACITY (32) /* records, oldest dropped when full */
+#define MQTT_STORE_DATA_LEN \
+    (MQTT_WORKER_MAX_TOPIC_LEN + MQTT_WORKER_MAX_PUBLISH_LEN)
+
+typedef struct mqtt_store_record {
+    uint32_t seq;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    uint8_t data[MQTT_STORE_DATA_LEN]; /* topic followed by payload */
+} mqtt_store_record_t;
+
+/* Ring log of one worker instance, fields are internal */
+typedef struct mqtt_store {
+    struct nvs_fs *fs;
+    uint16_t id_offset; /* added to NVS ids, separates instances */
+    struct {
+        uint32_t head; /* next seq to write */
+        uint32_t tail; /* oldest seq not acked yet */
+    } meta;
+    uint32_t send_seq;
+    uint32_t inflight; /* records handed out, neither acked nor failed */
+    bool rewind;       /* failure seen, send again once inflight drained */
+} mqtt_store_t;
+
+/**
+ * @brief Restore ring log position from flash. Records not acked before reboot
+ * are sent again, acked ones are never replayed.
+ * @param fs Mounted file system, NULL disables the store.
+ * @param id_offset Added to every NVS id used by this store
+ * @return 0 on success, negative value on error.
+ */
+int32_t mqtt_store_init(mqtt_store_t *store, struct nvs_fs *fs,
+                        uint16_t id_offset);
+
+/**
+ * @brief Append message to the ring log. When log is full the oldest record is
+ * dropped.
+ * @return Sequence number of the record, negative value on error.
+ */
+int32_t mqtt_store_append(mqtt_store_t *store, const char *topic,
+                          uint16_t topic_len, const uint8_t *payload,
+                          uint16_t payload_len);
+
+/**
+ * @brief Read next record which was not handed out yet and move send cursor
+ * behind it. Every record read must be finished by mqtt_store_ack() or
+ * mqtt_store_fail().
+ * @return 0 when record read, -ENOENT when nothing left to send, -EBUSY
+ * while a failure waits for records in flight.
+ */
+int32_t mqtt_store_next(mqtt_store_t *store, mqtt_store_record_t *rec);
+
+/**
+ * @brief Mark record as done, it is removed from flash. Also for records
+ * the broker rejected, sending them again would fail the same way.
+ */
+void mqtt_store_ack(mqtt_store_t *store, uint32_t seq);
+
+/**
+ * @brief Record was not delivered, e.g. timeout or lost connection. Send
+ * cursor moves back to the oldest not acked record once no other record
+ * is in flight, so none of them is sent twice.
+ */
+void mqtt_store_fail(mqtt_store_t *store, uint32_t seq);
+
+/**
+ * @brief Number of records waiting for delivery.
+ */
+uint32_t mqtt_store_count(mqtt_store_t *store);
+
+#endif /* MQTT_STORE_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
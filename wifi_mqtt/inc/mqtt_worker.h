@@ -6,49 +6,285 @@
 #ifndef MQTT_WORKER_H_
 #define MQTT_WORKER_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <zephyr/net/mqtt.h>
+#include <zephyr/sys/atomic.h>
+
+#include "mqtt_stats.h"
+#include "payload_cbor.h"
 
 #define MQTT_WORKER_CLIENT_ID           ("zephyrux")
+#define MQTT_WORKER_MAX_INSTANCES       (2) /* concurrent broker connections */
+#define MQTT_WORKER_STACK_SIZE          (2 * 1024) /* network thread of one */
+#define MQTT_WORKER_BUFFER_SIZE         CONFIG_APP_MQTT_BUFFER_SIZE
 #define MQTT_WORKER_MAX_TOPIC_LEN       (128)
-#define MQTT_WORKER_MAX_PAYLOAD_LEN     (256)
-#define MQTT_WORKER_MAX_PUBLISH_LEN     (256)
+#define MQTT_WORKER_SUBS_HEAP_SIZE      CONFIG_APP_MQTT_SUBS_HEAP_SIZE
+#define MQTT_WORKER_MAX_PUBLISH_LEN     CONFIG_APP_MQTT_MAX_PUBLISH_LEN
 #define MQTT_WORKER_PUBLISH_ACK_TIMEOUT (4) /* seconds */
+#define MQTT_WORKER_INFLIGHT_MAX        (4) /* QoS1 messages awaiting PUBACK */
+
+/* Received messages are handed to a pool of dispatch threads shared by all
+ * instances. Topic hash picks the thread, so messages of one topic are handled
+ * in order while other topics run in parallel. */
+#define MQTT_WORKER_DISPATCH_THREADS    CONFIG_APP_MQTT_DISPATCH_THREADS
+#define MQTT_WORKER_DISPATCH_QUEUE_LEN  CONFIG_APP_MQTT_DISPATCH_QUEUE_LEN
+#define MQTT_WORKER_DISPATCH_STACK_SIZE CONFIG_APP_MQTT_DISPATCH_STACK_SIZE
+
+/* With CONFIG_MQTT_VERSION_5_0 the worker connects with MQTT 5. Up to
+ * TOPIC_ALIASES topics, as many as the broker allows, are replaced by a two
+ * byte alias after their first publish in a connection. In-flight QoS1 are
+ * limited by broker Receive Maximum too. */
+#define MQTT_WORKER_TOPIC_ALIASES (4)
+
+/* With CONFIG_APP_MQTT_PERSISTENT_SESSION connect with clean_session=0.
+ * Client id is made unique once and kept in flash. Unacked QoS1 publishes are
+ * kept in RAM, sent again with DUP flag after reconnect and written to flash
+ * in batches, see MQTT_SESSION_FLUSH_PERIOD, so they survive reboot too. */
+#define MQTT_WORKER_PERSISTENT_SESSION                                         \
+    IS_ENABLED(CONFIG_APP_MQTT_PERSISTENT_SESSION)
+
+/* Keepalive sent to broker in CONNECT. Ping goes out only when nothing was
+ * sent or nothing was received for KEEPALIVE seconds, or right after a publish
+ * ack timeout. Link is dropped when PINGRESP misses PINGRESP_TIMEOUT. */
+#define MQTT_WORKER_KEEPALIVE        (60) /* seconds */
+#define MQTT_WORKER_PINGRESP_TIMEOUT (5)  /* seconds */
+
+/* Messages published while offline are kept in NVS and drained after
+ * reconnect, at most DRAIN_BATCH records every DRAIN_INTERVAL ms and only
+ * while more than LIVE_SLOTS publish slots are free. */
+#define MQTT_WORKER_STORE_DRAIN_BATCH    (2)
+#define MQTT_WORKER_STORE_DRAIN_INTERVAL (500) /* miliseconds */
+#define MQTT_WORKER_STORE_LIVE_SLOTS     (1)
+/* Offline publishes of mqtt_worker_publish_async() are copied to RAM and
+ * written to NVS by the network thread, so the caller never waits for
+ * flash. Up to STORE_PENDING of all instances wait at once. */
+#define MQTT_WORKER_STORE_PENDING        (4)
+
+/* Instance holds its rx and tx buffer only while connected, both are taken
+ * from one pool shared by all instances. Default fits all connected at once. */
+#define MQTT_WORKER_BUFFER_POOL_SIZE                                           \
+    (MQTT_WORKER_MAX_INSTANCES * 2 * MQTT_WORKER_BUFFER_SIZE + 256)
+
+/* Connection to one broker */
+typedef struct mqtt_worker mqtt_worker_t;
+
+typedef struct mqtt_worker_msg mqtt_worker_msg_t;
+
+/**
+ * @brief Subscription handler. Message is passed by reference and stays valid
+ * until handler calls mqtt_worker_msg_release(), which may happen later from
+ * any thread. When several filters match one topic every handler gets the same
+ * message and each must release it. Handlers are called from the dispatch
+ * thread of the topic, a slow handler delays only topics of its thread.
+ */
+typedef void (*subs_cb_t)(mqtt_worker_msg_t *msg);
 
-typedef void (*subs_cb_t)(char *topic, uint16_t topic_len, char *payload,
-                          uint16_t payload_len);
+/* Incoming message, topic and payload are both NUL terminated. */
+struct mqtt_worker_msg {
+    mqtt_worker_t *worker; /* connection message came from */
+    const char *topic;
+    uint16_t topic_len;
+    uint8_t *payload;
+    uint32_t payload_len;
+    atomic_t ref;         /* worker internal, handlers still holding the msg */
+    int64_t rx_ticks;     /* worker internal, receive-handler latency */
+    subs_cb_t *handlers;  /* worker internal, matched when received */
+    uint8_t handler_cnt;  /* worker internal */
+    uint8_t overflow;     /* worker internal, mqtt_worker_overflow_t */
+};
+
+/* What happens to a received message when its dispatch queue is full. With
+ * several filters matching one topic the last one in this list wins. */
+typedef enum mqtt_worker_overflow {
+    MQTT_WORKER_DROP_NEWEST,  /* received message is dropped */
+    MQTT_WORKER_DROP_OLDEST,  /* oldest message of the queue is dropped if
+                               * it came under DROP_OLDEST too, else the
+                               * received one */
+    MQTT_WORKER_BACKPRESSURE, /* socket of the instance is not read until
+                               * there is room, TCP slows the broker down */
+} mqtt_worker_overflow_t;
+
+/**
+ * @brief Asynchronous publish completion, called from mqtt worker thread so it
+ * must not block. To wake up an application thread raise a k_poll_signal or
+ * give a semaphore passed in user_data.
+ * @param message_id Id returned by mqtt_worker_publish_async()
+ * @param result 0 when PUBACK received, negative error otherwise, with MQTT 5
+ * positive failure reason code of the PUBACK (0x80 and above)
+ * @param user_data Pointer given to mqtt_worker_publish_async()
+ */
+typedef void (*publish_cb_t)(uint16_t message_id, int32_t result,
+                             void *user_data);
 
 /**
- * @brief Initialize worker. All next action will be executed in separated
- * thread. Function is not blocked, to verify if driver is connected with broker
- * use api below.
+ * @brief Initialize worker instance for one broker. All next action will be
+ * executed in separated thread. Function is not blocked, connection starts
+ * with mqtt_worker_connection_attempt(). Flash data of an instance (offline
+ * store, session, dns cache) is bound to its index, which is the order of
+ * mqtt_worker_init() calls, so keep the order stable.
  * @param hostname It can be name of host or string representation of ip addr.
  * @param port Broker port
- * @param subs Pointer to list of topics to be subscribed, NULL if no topics
- * should be subcribed
- * @param subs_cb Function to handle data incomming to subscribed topics, NULL
- * if not needed.
+ * @return Worker handle, NULL when all MQTT_WORKER_MAX_INSTANCES are used.
+ */
+mqtt_worker_t *mqtt_worker_init(const char *hostname, int32_t port);
+
+#if defined(CONFIG_MQTT_LIB_TLS)
+/**
+ * @brief Connect to the broker over TLS. Credentials must be registered with
+ * tls_credential_add() under sec_tag, at least the CA certificate, broker
+ * certificate is verified against it and the hostname given to
+ * mqtt_worker_init(). TLS session is cached in RAM and resumed on reconnect.
+ * Call before the first connection attempt.
+ * @return 0 on success, -EBUSY when not disconnected.
+ */
+int32_t mqtt_worker_tls_set(mqtt_worker_t *worker, sec_tag_t sec_tag);
+#endif
+
+/**
+ * @brief Attach handler to topic filter. All registered filters are subscribed
+ * after every broker connection, so register them before the first
+ * connection attempt. Filters registered later are subscribed on the next
+ * reconnect.
+ * @param filter Topic filter, '+' and '#' wildcards allowed. String is not
+ * copied and must stay valid.
+ * @param qos Requested subscription QoS, 0 or 1. QoS1 messages are acked
+ * once handed to the dispatch thread or dropped by the overflow policy.
+ * @param cb Handler called for every message matching the filter
+ * @param overflow Policy when dispatch thread of the topic falls behind.
+ * Backpressure stalls every topic of the instance until the handler catches
+ * up, use it for data which must not be lost. Held QoS1 message is acked
+ * only once queued, when the link drops meanwhile the broker sends it again.
+ * @return 0 on success, -ENOTSUP for QoS2, negative value on error.
  */
-void mqtt_worker_init(const char *hostname, int32_t port,
-                      struct mqtt_subscription_list *subs, subs_cb_t subs_cb);
+int32_t mqtt_worker_subscribe_topic(mqtt_worker_t *worker, const char *filter,
+                                    enum mqtt_qos qos, subs_cb_t cb,
+                                    mqtt_worker_overflow_t overflow);
 
 /**
  * @brief Publish data to given topic. Use in the same way as typical printf().
+ * Call blocks until PUBACK for this message arrives. Up to
+ * MQTT_WORKER_INFLIGHT_MAX threads may publish at the same time, each waits
+ * only for its own ack. Message is handed over to the network thread of the
+ * instance, the only thread which uses the MQTT client and its socket, so
+ * publishers never interleave on the wire. When client is not connected
+ * message is stored in flash and sent after reconnect.
+ * @param topic Topic where msg will be published
+ * @return 0 on success or when stored, -EMSGSIZE when formatted message does
+ * not fit MQTT_WORKER_MAX_PUBLISH_LEN, other negative value on error or ack
+ * timeout. With MQTT_WORKER_PERSISTENT_SESSION -ETIMEDOUT and -ENOTCONN mean
+ * the message was sent but not acked yet, it is sent again after reconnect.
+ * With MQTT 5 positive value is failure reason code of the PUBACK, e.g. 0x87
+ * not authorized.
+ */
+int32_t mqtt_worker_publish_qos1(mqtt_worker_t *worker, const char *topic,
+                                 const char *fmt, ...);
+
+/**
+ * @brief Publish typed fields encoded as one CBOR map, see payload_cbor.h.
+ * Fields are encoded straight into the publish slot, no text formatting is
+ * involved and the payload is several times smaller than its printf form.
+ * Blocks and stores offline the same way as mqtt_worker_publish_qos1().
+ * @param topic Topic where msg will be published
+ * @param fields Values to publish, e.g. PAYLOAD_FLOAT("temp", 21.5f)
+ * @param cnt Number of fields
+ * @return 0 on success or when stored, -EMSGSIZE when encoded fields do not
+ * fit MQTT_WORKER_MAX_PUBLISH_LEN, other values as mqtt_worker_publish_qos1().
+ */
+int32_t mqtt_worker_publish_cbor(mqtt_worker_t *worker, const char *topic,
+                                 const payload_field_t *fields, size_t cnt);
+
+/**
+ * @brief Publish payload of any size up to 64 kB without copying it. Packet
+ * header goes through the tx buffer, payload is handed to the socket as a
+ * separate iovec and streamed by TCP in segments, so neither tx buffer nor
+ * MQTT_WORKER_MAX_PUBLISH_LEN limit it. Blocks like mqtt_worker_publish_qos1().
+ * Payloads longer than MQTT_WORKER_MAX_PUBLISH_LEN are neither stored offline
+ * nor kept in persistent session.
+ * @param payload Data, must stay valid until the call returns
+ * @return 0 on success, -ENOTCONN when not connected and payload does not fit
+ * offline store, other values as mqtt_worker_publish_qos1().
+ */
+int32_t mqtt_worker_publish_large(mqtt_worker_t *worker, const char *topic,
+                                  const uint8_t *payload,
+                                  uint16_t payload_len);
+
+/**
+ * @brief Publish binary data with QoS1 without waiting for the ack. Topic and
+ * payload are copied, so both can be released right after the call. When
+ * client is not connected message is handed to the network thread, which
+ * stores it in flash, and sent after reconnect. The call does not wait for
+ * flash. Callback is not called for stored messages.
  * @param topic Topic where msg will be published
+ * @param payload Data to publish, up to MQTT_WORKER_MAX_PUBLISH_LEN bytes
+ * @param payload_len Payload length
+ * @param cb Completion callback, NULL if not needed
+ * @param user_data Passed to completion callback
+ * @return Message id (positive) when queued, 0 when stored offline, -ENOMEM
+ * when all MQTT_WORKER_INFLIGHT_MAX slots or MQTT_WORKER_STORE_PENDING
+ * offline copies are busy, other negative value on error.
+ */
+int32_t mqtt_worker_publish_async(mqtt_worker_t *worker, const char *topic,
+                                  const uint8_t *payload, uint16_t payload_len,
+                                  publish_cb_t cb, void *user_data);
+
+/**
+ * @brief Publish one part of the instance stats as CBOR map, keys are listed
+ * in mqtt_stats.h. Counters part gets high-water marks of objects shared by
+ * all instances, "subq" messages waiting for dispatch and, with
+ * CONFIG_SYS_HEAP_RUNTIME_STATS, "subh" bytes of received messages. With
+ * CONFIG_SHELL the same is printed by "mqtt stats" command. Blocks and stores
+ * offline the same way as mqtt_worker_publish_qos1().
+ * @param part Counters and latencies or state times, each fits
+ * MQTT_WORKER_MAX_PUBLISH_LEN
+ * @param topic Topic where stats will be published
+ * @return 0 on success or when stored, negative value on error.
  */
-int32_t mqtt_worker_publish_qos1(const char *topic, const char *fmt, ...);
+int32_t mqtt_worker_stats_publish(mqtt_worker_t *worker,
+                                  mqtt_stats_part_t part, const char *topic);
+
+/**
+ * @brief Encode the same map as mqtt_worker_stats_publish() into buf, e.g. to
+ * send it with mqtt_worker_publish_async() from a thread which must not block.
+ * @return Encoded length or negative error, see payload_cbor_encode().
+ */
+int32_t mqtt_worker_stats_encode(mqtt_worker_t *worker,
+                                 mqtt_stats_part_t part, uint8_t *buf,
+                                 size_t size);
+
+/**
+ * @brief Give message received by subs_cb_t back to the worker.
+ */
+void mqtt_worker_msg_release(mqtt_worker_msg_t *msg);
 
 /**
  * @brief Typically put to network disconnect callback to notify mqtt stack
- * about network absence. This will speed up reconnection process.
+ * about network absence. This will speed up reconnection process. Applies to
+ * all instances.
  */
 void mqtt_worker_disconnect(void);
 
 /**
- * @brief Make broker connection attempt.
+ * @brief Make broker connection attempt with all instances.
  */
 void mqtt_worker_connection_attempt(void);
 
+/**
+ * @brief Round timed wakeups of all instances (keepalive, publish ack
+ * deadline, store drain) up to multiples of period, so they happen together
+ * instead of each waking CPU and radio on its own. Typically DTIM interval
+ * of the access point, timers fire at most one period late. Grid starts at
+ * uptime 0, not at a beacon, so it coalesces wakeups but does not put them
+ * on beacons. Timers already due and PINGRESP deadline are not delayed.
+ * @param period_ms Grid of uptime milliseconds, 0 disables alignment
+ */
+void mqtt_worker_wake_align(uint32_t period_ms);
+
+/**
+ * @brief Check whether instance is connected and its topics are subscribed.
+ */
+bool mqtt_worker_connected(mqtt_worker_t *worker);
+
 #endif /* MQTT_WORKER_H_ */
 /* ---------------------------------------------------------------------------
  * end of file
@@ -0,0 +1,63 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: payload_cbor.h
+ * --------------------------------------------------------------------------*/
+#ifndef PAYLOAD_CBOR_H_
+#define PAYLOAD_CBOR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum payload_field_type {
+    PAYLOAD_FIELD_INT,
+    PAYLOAD_FIELD_FLOAT,
+    PAYLOAD_FIELD_BOOL,
+    PAYLOAD_FIELD_STR
+} payload_field_type_t;
+
+/* One typed value of a sensor message, key is not copied */
+typedef struct payload_field {
+    const char *key;
+    payload_field_type_t type;
+    union {
+        int32_t i;
+        float f;
+        bool b;
+        const char *s;
+    } value;
+} payload_field_t;
+
+#define PAYLOAD_INT(k, v)                                                      \
+    { .key = (k), .type = PAYLOAD_FIELD_INT, .value.i = (v) }
+#define PAYLOAD_FLOAT(k, v)                                                    \
+    { .key = (k), .type = PAYLOAD_FIELD_FLOAT, .value.f = (v) }
+#define PAYLOAD_BOOL(k, v)                                                     \
+    { .key = (k), .type = PAYLOAD_FIELD_BOOL, .value.b = (v) }
+#define PAYLOAD_STR(k, v)                                                      \
+    { .key = (k), .type = PAYLOAD_FIELD_STR, .value.s = (v) }
+
+/**
+ * @brief Encode fields as one CBOR map, keys as text strings. Integer takes
+ * 1-5 bytes and float 5 bytes, a small fraction of its printf form.
+ * @param buf Output buffer, typically publish slot of mqtt worker
+ * @return Encoded length, -EMSGSIZE when buffer is too small, -EINVAL for
+ * unknown field type.
+ */
+int32_t payload_cbor_encode(const payload_field_t *fields, size_t cnt,
+                            uint8_t *buf, size_t size);
+
+#define PAYLOAD_CBOR_ARRAY_HEAD_MAX (3) /* up to 65535 items */
+
+/**
+ * @brief Encode head of definite length array, items follow right after it.
+ * @param buf At least PAYLOAD_CBOR_ARRAY_HEAD_MAX bytes
+ * @return Head length, 1 to PAYLOAD_CBOR_ARRAY_HEAD_MAX bytes.
+ */
+int32_t payload_cbor_array_head(uint8_t *buf, uint16_t cnt);
+
+#endif /* PAYLOAD_CBOR_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
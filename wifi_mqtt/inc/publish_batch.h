@@ -0,0 +1,44 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: publish_batch.h
+ * --------------------------------------------------------------------------*/
+#ifndef PUBLISH_BATCH_H_
+#define PUBLISH_BATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_worker.h"
+#include "payload_cbor.h"
+
+#define PUBLISH_BATCH_MAX_TOPICS (4) /* topics collected at the same time */
+#define PUBLISH_BATCH_RETRY      (100) /* miliseconds, when no slot free */
+
+/* Readings wait at most this long before their batch is published */
+#define PUBLISH_BATCH_LATENCY CONFIG_APP_PUBLISH_BATCH_LATENCY_MS
+
+/**
+ * @brief Queue one reading for topic. Readings of the same topic are packed
+ * into one CBOR array of maps and sent as a single QoS1 message when the
+ * array would exceed MQTT_WORKER_MAX_PUBLISH_LEN or PUBLISH_BATCH_LATENCY
+ * after its first reading, whichever comes first. Batches are sent with
+ * mqtt_worker_publish_async(), so offline they go to the flash store.
+ * @param topic Topic of the batch, copied
+ * @param fields Values of one reading, encoded right away
+ * @return 0 on success, -ENOMEM when PUBLISH_BATCH_MAX_TOPICS topics are
+ * already collected, -EMSGSIZE when single reading does not fit, -ENOBUFS
+ * when full batch could not be sent yet.
+ */
+int32_t publish_batch_add(mqtt_worker_t *worker, const char *topic,
+                          const payload_field_t *fields, size_t cnt);
+
+/**
+ * @brief Send all collected readings now, e.g. before going to sleep.
+ */
+void publish_batch_flush(void);
+
+#endif /* PUBLISH_BATCH_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
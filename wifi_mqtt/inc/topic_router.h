@@ -0,0 +1,76 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: topic_router.h
+ * --------------------------------------------------------------------------*/
+#ifndef TOPIC_ROUTER_H_
+#define TOPIC_ROUTER_H_
+
+#include <stdint.h>
+#include <zephyr/net/mqtt.h>
+
+#include "mqtt_worker.h"
+
+#define TOPIC_ROUTER_MAX_FILTERS (8)
+#define TOPIC_ROUTER_MAX_NODES   (32) /* topic levels of all filters */
+
+/* One topic level in the filter trie, children kept as sibling list */
+typedef struct topic_router_node {
+    const char *level;
+    uint16_t level_len;
+    uint32_t hash;
+    int16_t child;
+    int16_t sibling;
+    int16_t route; /* filter index when a filter ends at this level */
+} topic_router_node_t;
+
+typedef struct topic_router {
+    topic_router_node_t nodes[TOPIC_ROUTER_MAX_NODES];
+    uint16_t node_cnt;
+    subs_cb_t handlers[TOPIC_ROUTER_MAX_FILTERS];
+    mqtt_worker_overflow_t overflow[TOPIC_ROUTER_MAX_FILTERS];
+    struct mqtt_topic topics[TOPIC_ROUTER_MAX_FILTERS];
+    struct mqtt_subscription_list subs;
+} topic_router_t;
+
+/**
+ * @brief Attach handler to topic filter. Zero initialized router is ready to
+ * use.
+ * @param filter MQTT topic filter, '+' and '#' wildcards allowed. String is
+ * not copied and must stay valid.
+ * @param overflow Dispatch queue overflow policy of the filter
+ * @return 0 on success, -EINVAL for empty or malformed filter, -EEXIST when
+ * filter is already registered, -ENOMEM when router is full. Router is left
+ * unchanged on error.
+ */
+int32_t topic_router_add(topic_router_t *router, const char *filter,
+                         enum mqtt_qos qos, subs_cb_t cb,
+                         mqtt_worker_overflow_t overflow);
+
+/**
+ * @brief Find handlers of all filters matching topic. Cost depends on number
+ * of topic levels, not on number of registered filters.
+ * @param overflow Raised to the strictest policy of matching filters, set it
+ * to MQTT_WORKER_DROP_NEWEST before the call.
+ * @return Number of handlers stored in handlers array.
+ */
+int32_t topic_router_match(const topic_router_t *router, const char *topic,
+                           uint16_t topic_len, subs_cb_t *handlers,
+                           int32_t max, mqtt_worker_overflow_t *overflow);
+
+/**
+ * @brief FNV-1a hash of a string, same as used for topic levels.
+ */
+uint32_t topic_router_hash(const char *str, uint16_t len);
+
+/**
+ * @brief Subscription list built from registered filters, caller sets its
+ * message_id before every SUBSCRIBE.
+ * @return List pointer, NULL if no filter registered.
+ */
+struct mqtt_subscription_list *topic_router_subs_list(topic_router_t *router);
+
+#endif /* TOPIC_ROUTER_H_ */
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
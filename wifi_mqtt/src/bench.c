@@ -0,0 +1,181 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: bench.c
+ * --------------------------------------------------------------------------*/
+#include "bench.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/printk.h>
+
+#include "mqtt_worker.h"
+
+LOG_MODULE_REGISTER(BENCH, LOG_LEVEL_DBG);
+
+#define BENCH_TOPIC    "/bench/zephyr/loop"
+#define BENCH_MESSAGES CONFIG_APP_BENCH_MESSAGES
+#define BENCH_TIMEOUT  (10) /* seconds, waiting for the last acks */
+
+/* Start of every payload, rest is filler up to the tested size */
+typedef struct bench_stamp {
+    uint32_t run;
+    uint32_t idx;
+    int64_t ticks;
+} bench_stamp_t;
+
+static void bench_size(mqtt_worker_t *worker, uint16_t size);
+static void bench_puback_cb(uint16_t message_id, int32_t result,
+                            void *user_data);
+static void bench_subs_cb(mqtt_worker_msg_t *msg);
+static void bench_report(const char *name, uint32_t *lat, uint32_t cnt);
+static int compare_u32(const void *a, const void *b);
+
+static const uint16_t Sizes[] = {16, 64, 128, MQTT_WORKER_MAX_PUBLISH_LEN};
+
+static uint32_t Run = 0;
+static int64_t SentTicks[BENCH_MESSAGES];
+static uint32_t AckLat[BENCH_MESSAGES]; /* microseconds */
+static uint32_t RxLat[BENCH_MESSAGES];
+static atomic_t AckCnt;
+static atomic_t AckErrCnt;
+static atomic_t RxCnt;
+static uint8_t Payload[MQTT_WORKER_MAX_PUBLISH_LEN];
+
+K_SEM_DEFINE(BenchProgress, 0, 1);
+
+void bench_run(void) {
+    mqtt_worker_t *worker = mqtt_worker_init(CONFIG_APP_BENCH_BROKER,
+                                             CONFIG_APP_BENCH_PORT);
+    if (NULL == worker) {
+        return;
+    }
+
+    /* every loopback message is counted, none may be lost */
+    mqtt_worker_subscribe_topic(worker, BENCH_TOPIC, MQTT_QOS_0_AT_MOST_ONCE,
+                                bench_subs_cb, MQTT_WORKER_BACKPRESSURE);
+    mqtt_worker_connection_attempt();
+
+    int64_t deadline =
+        k_uptime_get() + CONFIG_APP_BENCH_CONNECT_TIMEOUT * MSEC_PER_SEC;
+    while (!mqtt_worker_connected(worker)) {
+        if (k_uptime_get() >= deadline) {
+            printk("Bench failed, no connection to %s:%d\n",
+                   CONFIG_APP_BENCH_BROKER, CONFIG_APP_BENCH_PORT);
+            return;
+        }
+        k_sleep(K_MSEC(100));
+    }
+
+    printk("Bench %s:%d, %d messages per size\n", CONFIG_APP_BENCH_BROKER,
+           CONFIG_APP_BENCH_PORT, BENCH_MESSAGES);
+
+    for (int32_t i = 0; i < ARRAY_SIZE(Sizes); i++) {
+        bench_size(worker, Sizes[i]);
+    }
+
+    printk("Bench done\n");
+}
+
+static void bench_size(mqtt_worker_t *worker, uint16_t size) {
+    bench_stamp_t stamp = {.run = ++Run};
+
+    memset(Payload, 'x', sizeof(Payload));
+    atomic_set(&AckCnt, 0);
+    atomic_set(&AckErrCnt, 0);
+    atomic_set(&RxCnt, 0);
+
+    int64_t start_ms = k_uptime_get();
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++) {
+        stamp.idx = i;
+        stamp.ticks = k_uptime_ticks();
+        memcpy(Payload, &stamp, sizeof(stamp));
+        SentTicks[i] = stamp.ticks;
+
+        for (;;) {
+            int32_t res = mqtt_worker_publish_async(
+                worker, BENCH_TOPIC, Payload, size, bench_puback_cb,
+                (void *)(uintptr_t)i);
+            if (-ENOMEM != res) {
+                break;
+            }
+            /* all slots in flight, next ack frees one */
+            k_sem_take(&BenchProgress, K_MSEC(100));
+        }
+    }
+
+    int64_t deadline = k_uptime_get() + BENCH_TIMEOUT * MSEC_PER_SEC;
+    while (BENCH_MESSAGES > atomic_get(&AckCnt) + atomic_get(&AckErrCnt) &&
+           k_uptime_get() < deadline) {
+        k_sem_take(&BenchProgress, K_MSEC(100));
+    }
+    int64_t elapsed_ms = MAX(k_uptime_get() - start_ms, 1);
+
+    /* loopback messages may still be on the way */
+    while (atomic_get(&AckCnt) > atomic_get(&RxCnt) &&
+           k_uptime_get() < deadline) {
+        k_sleep(K_MSEC(10));
+    }
+
+    uint32_t acked = atomic_get(&AckCnt);
+    printk("size %u: %u acked, %d failed, %u msg/s\n", size, acked,
+           (int32_t)atomic_get(&AckErrCnt),
+           (uint32_t)(acked * MSEC_PER_SEC / elapsed_ms));
+    bench_report("  publish-puback", AckLat, acked);
+    bench_report("  publish-callback", RxLat, atomic_get(&RxCnt));
+}
+
+static void bench_puback_cb(uint16_t message_id, int32_t result,
+                            void *user_data) {
+    uint32_t idx = (uint32_t)(uintptr_t)user_data;
+
+    if (0 != result) {
+        atomic_inc(&AckErrCnt);
+    } else {
+        int64_t ticks = k_uptime_ticks() - SentTicks[idx];
+        AckLat[atomic_inc(&AckCnt)] = (uint32_t)k_ticks_to_us_floor64(ticks);
+    }
+    k_sem_give(&BenchProgress);
+}
+
+static void bench_subs_cb(mqtt_worker_msg_t *msg) {
+    bench_stamp_t stamp;
+
+    if (sizeof(stamp) <= msg->payload_len) {
+        memcpy(&stamp, msg->payload, sizeof(stamp));
+        /* retained message of previous run is skipped */
+        uint32_t cnt = atomic_get(&RxCnt);
+        if (Run == stamp.run && BENCH_MESSAGES > cnt) {
+            int64_t ticks = k_uptime_ticks() - stamp.ticks;
+            RxLat[cnt] = (uint32_t)k_ticks_to_us_floor64(ticks);
+            atomic_inc(&RxCnt);
+        }
+    }
+    mqtt_worker_msg_release(msg);
+}
+
+static void bench_report(const char *name, uint32_t *lat, uint32_t cnt) {
+    if (0 == cnt) {
+        printk("%s: no samples\n", name);
+        return;
+    }
+
+    qsort(lat, cnt, sizeof(uint32_t), compare_u32);
+    printk("%s: p50 %u us, p99 %u us, max %u us\n", name, lat[cnt / 2],
+           lat[(cnt * 99) / 100], lat[cnt - 1]);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return ((x > y) - (x < y));
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
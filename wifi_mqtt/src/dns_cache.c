@@ -0,0 +1,107 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: dns_cache.c
+ * --------------------------------------------------------------------------*/
+#include "dns_cache.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "nvs_storage.h"
+
+LOG_MODULE_REGISTER(DNS_CACHE, CONFIG_APP_DNS_CACHE_LOG_LEVEL);
+
+#define DNS_CACHE_ID(cache) ((cache)->id_offset + NVS_STORAGE_ID_DNS_CACHE)
+
+void dns_cache_init(dns_cache_t *cache, struct nvs_fs *fs, uint16_t id_offset,
+                    const char *hostname) {
+    memset(cache, 0, sizeof(*cache));
+    cache->fs = fs;
+    cache->id_offset = id_offset;
+
+    if (NULL != cache->fs) {
+        ssize_t rc = nvs_read(cache->fs, DNS_CACHE_ID(cache), &cache->record,
+                              sizeof(cache->record));
+        if (sizeof(cache->record) != rc ||
+            DNS_CACHE_MAX_ADDRS < cache->record.count ||
+            0 != strncmp(cache->record.host, hostname,
+                         sizeof(cache->record.host))) {
+            memset(&cache->record, 0, sizeof(cache->record));
+        }
+    }
+
+    strncpy(cache->record.host, hostname, sizeof(cache->record.host) - 1);
+    /* time powered off is unknown, restored addresses are only a fallback
+     * when lookup fails */
+    cache->expiry_ms = 0;
+    cache->first = 0;
+    cache->tried = 0;
+
+    LOG_INF("%u addresses of %s restored", cache->record.count,
+            cache->record.host);
+}
+
+int32_t dns_cache_update(dns_cache_t *cache,
+                         const struct zsock_addrinfo *res) {
+    uint32_t count = 0;
+
+    for (; NULL != res && DNS_CACHE_MAX_ADDRS > count; res = res->ai_next) {
+        if (AF_INET != res->ai_family) {
+            continue;
+        }
+        cache->record.addrs[count++] = net_sin(res->ai_addr)->sin_addr;
+    }
+
+    if (0 == count) {
+        /* keep previous addresses as fallback */
+        return (0);
+    }
+
+    cache->record.count = count;
+    cache->expiry_ms = k_uptime_get() + DNS_CACHE_TTL * MSEC_PER_SEC;
+    cache->first = 0;
+    cache->tried = 0;
+
+    if (NULL != cache->fs) {
+        /* nvs skips the write when stored record is the same */
+        ssize_t rc = nvs_write(cache->fs, DNS_CACHE_ID(cache), &cache->record,
+                               sizeof(cache->record));
+        if (0 > rc) {
+            LOG_ERR("Failed to save dns cache, err %d", (int32_t)rc);
+        }
+    }
+
+    return ((int32_t)count);
+}
+
+int32_t dns_cache_next(dns_cache_t *cache, struct in_addr *addr, bool stale) {
+    if (0 == cache->record.count) {
+        return (-ENOENT);
+    }
+
+    if (!stale && (cache->record.count <= cache->tried ||
+                   cache->expiry_ms <= k_uptime_get())) {
+        return (-ENOENT);
+    }
+
+    uint32_t idx = (cache->first + cache->tried) % cache->record.count;
+    *addr = cache->record.addrs[idx];
+    cache->tried++;
+
+    return (0);
+}
+
+void dns_cache_confirm(dns_cache_t *cache) {
+    if (0 < cache->tried) {
+        cache->first = (cache->first + cache->tried - 1) % cache->record.count;
+        cache->tried = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
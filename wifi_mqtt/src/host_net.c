@@ -0,0 +1,52 @@
+/* ---------------------------------------------------------------------------
+ *  wifi
+ * ---------------------------------------------------------------------------
+ *  Name: host_net.c
+ * --------------------------------------------------------------------------*/
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "wifi_net.h"
+
+LOG_MODULE_REGISTER(HOST_NET, LOG_LEVEL_DBG);
+
+static struct {
+    wifi_net_cb_t cb;
+    void *user_data;
+} Listeners[WIFI_NET_MAX_LISTENERS];
+static int32_t ListenersCnt = 0;
+
+int32_t wifi_net_listener_add(wifi_net_cb_t cb, void *user_data) {
+    if (WIFI_NET_MAX_LISTENERS <= ListenersCnt) {
+        LOG_ERR("Too many listeners");
+        return (-ENOMEM);
+    }
+
+    Listeners[ListenersCnt].cb = cb;
+    Listeners[ListenersCnt].user_data = user_data;
+    ListenersCnt++;
+    return (0);
+}
+
+/* Replaces wifi_net.c on native_sim, sockets are offloaded to the host
+ * network which is always up, so there is nothing to join or wait for. */
+void wifi_net_init(char *ssid, char *passwd) {
+    LOG_INF("Host network, ssid ignored");
+    for (int32_t i = 0; i < ListenersCnt; i++) {
+        Listeners[i].cb(WIFI_NET_LINK_UP, Listeners[i].user_data);
+        Listeners[i].cb(WIFI_NET_IP_READY, Listeners[i].user_data);
+    }
+}
+
+int32_t wifi_net_wait_ready(k_timeout_t timeout) {
+    return (0);
+}
+
+uint32_t wifi_net_dtim_ms(void) {
+    return (0);
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -10,10 +10,23 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/net/mqtt.h>
 
+#include "bench.h"
 #include "config_wifi.h"
 #include "mqtt_worker.h"
+#include "nvs_storage.h"
+#include "publish_batch.h"
 #include "wifi_net.h"
 
+#if defined(CONFIG_MQTT_LIB_TLS)
+#include "config_tls.h"
+#define BROKER_HOST    TLS_BROKER_HOST
+#define BROKER_PORT    TLS_BROKER_PORT
+#define BROKER_SEC_TAG (1)
+#else
+#define BROKER_HOST "test.mosquitto.org"
+#define BROKER_PORT (1883)
+#endif
+
 LOG_MODULE_REGISTER(MAIN, LOG_LEVEL_DBG);
 
 static const struct gpio_dt_spec InfoLed =
@@ -21,11 +34,46 @@ static const struct gpio_dt_spec InfoLed =
 
 #define SUBSCRIBE_TOPIC "/test/mosquitto/pubsub/topic"
 #define PUBLISH_TOPIC   "/test/mosquitto/publish/esp32"
+#define STATUS_TOPIC    "/test/mosquitto/publish/esp32/status"
+#define LED_TOPIC       "/test/mosquitto/publish/esp32/led"
+#define METRICS_TOPIC   "/test/mosquitto/publish/esp32/metrics"
+#define STATES_TOPIC    "/test/mosquitto/publish/esp32/metrics/states"
+
+/* Encoded status and metrics, copied by mqtt_worker_publish_async() */
+static uint8_t ReportBuf[MQTT_WORKER_MAX_PUBLISH_LEN];
+
+void subs_cb(mqtt_worker_msg_t *msg) {
+    LOG_INF("Topic: %s", msg->topic);
+    LOG_INF("Payload: %s", msg->payload);
+    mqtt_worker_msg_release(msg);
+}
+
+void publish_done_cb(uint16_t message_id, int32_t result, void *user_data) {
+    if (0 != result) {
+        LOG_ERR("Publish %u failed, err %d", message_id, result);
+    }
+}
 
-void subs_cb(char *topic, uint16_t topic_len, char *payload,
-             uint16_t payload_len) {
-    LOG_INF("Topic: %s", topic);
-    LOG_INF("Payload: %s", payload);
+/* Brokers follow the address, not the association, DNS and connect need IP */
+void net_event_cb(wifi_net_event_t event, void *user_data) {
+    switch (event) {
+        case WIFI_NET_LINK_UP: {
+            mqtt_worker_wake_align(wifi_net_dtim_ms());
+            break;
+        }
+        case WIFI_NET_IP_READY: {
+            mqtt_worker_connection_attempt();
+            break;
+        }
+        case WIFI_NET_IP_LOST:
+        case WIFI_NET_LINK_DOWN: {
+            mqtt_worker_disconnect();
+            break;
+        }
+        default: {
+            break;
+        }
+    }
 }
 
 int main(void) {
@@ -43,13 +91,29 @@ int main(void) {
         return (0);
     }
 
-    struct mqtt_topic subs_topic = {
-        .topic = {.utf8 = (uint8_t *)SUBSCRIBE_TOPIC,
-                  .size = strlen(SUBSCRIBE_TOPIC)},
-        .qos = MQTT_QOS_0_AT_MOST_ONCE};
-    struct mqtt_subscription_list subs_list = {
-        .list = &subs_topic, .list_count = 1U, .message_id = 1U};
-    mqtt_worker_init("test.mosquitto.org", 1883, &subs_list, subs_cb);
+    ret = nvs_storage_init();
+    if (0 != ret) {
+        LOG_WRN("Storage not available, err %d", ret);
+    }
+    wifi_net_listener_add(net_event_cb, NULL);
+
+#if defined(CONFIG_APP_BENCH)
+    wifi_net_init(WIFI_SSID, WIFI_PASS);
+    bench_run();
+    return (0);
+#endif
+
+    mqtt_worker_t *mqtt = mqtt_worker_init(BROKER_HOST, BROKER_PORT);
+#if defined(CONFIG_MQTT_LIB_TLS)
+    ret = tls_credential_add(BROKER_SEC_TAG, TLS_CREDENTIAL_CA_CERTIFICATE,
+                             TLS_CA_CERT, sizeof(TLS_CA_CERT));
+    if (0 != ret) {
+        LOG_ERR("CA certificate not added, err %d", ret);
+    }
+    mqtt_worker_tls_set(mqtt, BROKER_SEC_TAG);
+#endif
+    mqtt_worker_subscribe_topic(mqtt, SUBSCRIBE_TOPIC, MQTT_QOS_0_AT_MOST_ONCE,
+                                subs_cb, MQTT_WORKER_DROP_OLDEST);
 
     wifi_net_init(WIFI_SSID, WIFI_PASS);
 
@@ -58,9 +122,50 @@ int main(void) {
         k_sleep(K_SECONDS(1));
         gpio_pin_toggle_dt(&InfoLed);
 
+        /* one reading per second, sent in batches */
+        payload_field_t reading[] = {
+            PAYLOAD_INT("t", k_uptime_get_32()),
+            PAYLOAD_BOOL("led", gpio_pin_get_dt(&InfoLed)),
+        };
+        publish_batch_add(mqtt, LED_TOPIC, reading, ARRAY_SIZE(reading));
+
         lopp_cnt++;
         if (0 == lopp_cnt % 8) {
-            mqtt_worker_publish_qos1(PUBLISH_TOPIC, "ESP32_TEST");
+            mqtt_worker_publish_async(mqtt, PUBLISH_TOPIC,
+                                      (uint8_t *)"ESP32_TEST",
+                                      strlen("ESP32_TEST"), publish_done_cb,
+                                      NULL);
+        }
+        if (0 == lopp_cnt % 60) {
+            payload_field_t status[] = {
+                PAYLOAD_INT("uptime", k_uptime_get() / MSEC_PER_SEC),
+                PAYLOAD_BOOL("led", gpio_pin_get_dt(&InfoLed)),
+            };
+            /* LED keeps blinking while the broker is slow to ack */
+            int32_t len = payload_cbor_encode(status, ARRAY_SIZE(status),
+                                              ReportBuf, sizeof(ReportBuf));
+            if (0 < len) {
+                mqtt_worker_publish_async(mqtt, STATUS_TOPIC, ReportBuf, len,
+                                          publish_done_cb, NULL);
+            }
+
+            len = mqtt_worker_stats_encode(mqtt, MQTT_STATS_PART_COUNTERS,
+                                           ReportBuf, sizeof(ReportBuf));
+            if (0 < len) {
+                mqtt_worker_publish_async(mqtt, METRICS_TOPIC, ReportBuf, len,
+                                          publish_done_cb, NULL);
+            } else {
+                LOG_ERR("Metrics encode failed, err %d", len);
+            }
+
+            len = mqtt_worker_stats_encode(mqtt, MQTT_STATS_PART_STATES,
+                                           ReportBuf, sizeof(ReportBuf));
+            if (0 < len) {
+                mqtt_worker_publish_async(mqtt, STATES_TOPIC, ReportBuf, len,
+                                          publish_done_cb, NULL);
+            } else {
+                LOG_ERR("State stats encode failed, err %d", len);
+            }
         }
     }
 }
@@ -0,0 +1,329 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: mqtt_session.c
+ * --------------------------------------------------------------------------*/
+#include "mqtt_session.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/random/random.h>
+
+#include "nvs_storage.h"
+
+LOG_MODULE_REGISTER(MQTT_SESSION, CONFIG_APP_MQTT_SESSION_LOG_LEVEL);
+
+#define SESSION_ENTRY_HDR_LEN (offsetof(mqtt_session_entry_t, data))
+#define SESSION_META_ID(session)                                               \
+    ((session)->id_offset + NVS_STORAGE_ID_MQTT_SESSION_META)
+#define SESSION_ENTRY_ID(session, idx)                                         \
+    ((session)->id_offset + NVS_STORAGE_ID_MQTT_SESSION_BASE + (idx))
+
+BUILD_ASSERT(32 >= MQTT_SESSION_MAX_UNACKED, "Entry bits do not fit");
+
+static int32_t session_find(mqtt_session_t *session, uint16_t message_id);
+static void session_meta_save(mqtt_session_t *session);
+static void session_dirty_set(mqtt_session_t *session, int32_t idx);
+
+/* Shared by all instances */
+K_MUTEX_DEFINE(SessionLock);
+
+void mqtt_session_init(mqtt_session_t *session, struct nvs_fs *fs,
+                       uint16_t id_offset) {
+    int32_t unacked = 0;
+
+    k_mutex_lock(&SessionLock, K_FOREVER);
+    memset(session, 0, sizeof(*session));
+    session->fs = fs;
+    session->id_offset = id_offset;
+
+    if (NULL != session->fs) {
+        ssize_t rc = nvs_read(session->fs, SESSION_META_ID(session),
+                              &session->meta, sizeof(session->meta));
+        if (sizeof(session->meta) != rc) {
+            memset(&session->meta, 0, sizeof(session->meta));
+        }
+
+        for (int32_t i = 0; i < MQTT_SESSION_MAX_UNACKED; i++) {
+            mqtt_session_entry_t *entry = &session->entries[i];
+            rc = nvs_read(session->fs, SESSION_ENTRY_ID(session, i), entry,
+                          sizeof(*entry));
+            if (SESSION_ENTRY_HDR_LEN > rc || 0U == entry->message_id ||
+                MQTT_SESSION_DATA_LEN <
+                    entry->topic_len + entry->payload_len ||
+                SESSION_ENTRY_HDR_LEN + entry->topic_len +
+                        entry->payload_len !=
+                    rc) {
+                memset(entry, 0, sizeof(*entry));
+                continue;
+            }
+            session->in_flash |= BIT(i);
+            session->next_seq = MAX(session->next_seq, entry->seq + 1);
+            unacked++;
+        }
+    }
+    session->flush_at = INT64_MAX;
+
+    char *client_id = session->meta.client_id;
+    client_id[sizeof(session->meta.client_id) - 1] = '\0';
+    if (!MQTT_WORKER_PERSISTENT_SESSION) {
+        /* clean session, broker keeps nothing bound to the id */
+        snprintf(client_id, sizeof(session->meta.client_id), "%s",
+                 MQTT_WORKER_CLIENT_ID);
+    } else if ('\0' == client_id[0]) {
+        snprintf(client_id, sizeof(session->meta.client_id), "%s-%08x",
+                 MQTT_WORKER_CLIENT_ID, sys_rand32_get());
+        session_meta_save(session);
+    }
+
+    session->next_id = (0U == session->meta.next_id) ? 1U
+                                                     : session->meta.next_id;
+    session->ids_left = 0U;
+
+    LOG_INF("Client id %s, %d unacked messages", client_id, unacked);
+    k_mutex_unlock(&SessionLock);
+}
+
+const char *mqtt_session_client_id(mqtt_session_t *session) {
+    return (session->meta.client_id);
+}
+
+uint16_t mqtt_session_message_id_next(mqtt_session_t *session) {
+    uint16_t id = 0U;
+
+    k_mutex_lock(&SessionLock, K_FOREVER);
+    do {
+        if (0U == session->ids_left) {
+            /* ids must not repeat after reboot only while the broker keeps
+             * the session, clean session starts over */
+            if (MQTT_WORKER_PERSISTENT_SESSION) {
+                session->meta.next_id =
+                    session->next_id + MQTT_SESSION_ID_BLOCK;
+                session_meta_save(session);
+            }
+            session->ids_left = MQTT_SESSION_ID_BLOCK;
+        }
+
+        id = session->next_id;
+        session->ids_left--;
+        session->next_id += 1U;
+        if (0U == session->next_id) { /* 0 is not valid packet id */
+            session->next_id = 1U;
+        }
+    } while (0U == id || 0 <= session_find(session, id));
+    k_mutex_unlock(&SessionLock);
+
+    return (id);
+}
+
+int32_t mqtt_session_track(mqtt_session_t *session, uint16_t message_id,
+                           const char *topic, uint16_t topic_len,
+                           const uint8_t *payload, uint16_t payload_len,
+                           bool retain) {
+    int32_t idx = 0;
+
+    if (MQTT_SESSION_DATA_LEN < (topic_len + payload_len)) {
+        return (-EMSGSIZE);
+    }
+
+    k_mutex_lock(&SessionLock, K_FOREVER);
+
+    /* free entry, otherwise the oldest one */
+    for (int32_t i = 0; i < MQTT_SESSION_MAX_UNACKED; i++) {
+        if (0U == session->entries[i].message_id) {
+            idx = i;
+            break;
+        }
+        if (session->entries[i].seq < session->entries[idx].seq) {
+            idx = i;
+        }
+    }
+
+    mqtt_session_entry_t *entry = &session->entries[idx];
+    if (0U != entry->message_id) {
+        LOG_WRN("Session full, drop unacked id %u", entry->message_id);
+    }
+
+    entry->seq = session->next_seq++;
+    entry->message_id = message_id;
+    entry->topic_len = topic_len;
+    entry->payload_len = payload_len;
+    entry->retain = retain ? 1U : 0U;
+    memcpy(entry->data, topic, topic_len);
+    memcpy(entry->data + topic_len, payload, payload_len);
+    session_dirty_set(session, idx);
+
+    k_mutex_unlock(&SessionLock);
+    return (0);
+}
+
+bool mqtt_session_release(mqtt_session_t *session, uint16_t message_id) {
+    k_mutex_lock(&SessionLock, K_FOREVER);
+    int32_t idx = session_find(session, message_id);
+    if (0 <= idx) {
+        session->entries[idx].message_id = 0U;
+        session_dirty_set(session, idx);
+    }
+    k_mutex_unlock(&SessionLock);
+
+    return (0 <= idx);
+}
+
+int32_t mqtt_session_resend_start(mqtt_session_t *session) {
+    int32_t cnt = 0;
+
+    k_mutex_lock(&SessionLock, K_FOREVER);
+    session->resend_seq = 0U;
+    session->resend_end = session->next_seq;
+    for (int32_t i = 0; i < MQTT_SESSION_MAX_UNACKED; i++) {
+        if (0U != session->entries[i].message_id) {
+            cnt++;
+        }
+    }
+    k_mutex_unlock(&SessionLock);
+
+    return (cnt);
+}
+
+uint16_t mqtt_session_resend_next(mqtt_session_t *session, char *topic,
+                                  uint16_t *topic_len, uint8_t *payload,
+                                  uint16_t *payload_len, bool *retain) {
+    uint16_t message_id = 0U;
+
+    k_mutex_lock(&SessionLock, K_FOREVER);
+    while (0U == message_id && session->resend_seq < session->resend_end) {
+        int32_t idx = -1;
+
+        /* oldest entry not sent again yet */
+        for (int32_t i = 0; i < MQTT_SESSION_MAX_UNACKED; i++) {
+            mqtt_session_entry_t *entry = &session->entries[i];
+            if (0U == entry->message_id ||
+                entry->seq < session->resend_seq ||
+                entry->seq >= session->resend_end) {
+                continue;
+            }
+            if (0 > idx || entry->seq < session->entries[idx].seq) {
+                idx = i;
+            }
+        }
+        if (0 > idx) {
+            session->resend_seq = session->resend_end;
+            break;
+        }
+
+        mqtt_session_entry_t *entry = &session->entries[idx];
+        session->resend_seq = entry->seq + 1U;
+        if (MQTT_WORKER_MAX_TOPIC_LEN < entry->topic_len ||
+            MQTT_WORKER_MAX_PUBLISH_LEN < entry->payload_len) {
+            /* tracked from large publish, can not be copied */
+            LOG_WRN("Unacked id %u too large to resend, dropped",
+                    entry->message_id);
+            entry->message_id = 0U;
+            session_dirty_set(session, idx);
+            continue;
+        }
+
+        message_id = entry->message_id;
+        memcpy(topic, entry->data, entry->topic_len);
+        *topic_len = entry->topic_len;
+        memcpy(payload, entry->data + entry->topic_len, entry->payload_len);
+        *payload_len = entry->payload_len;
+        *retain = (0U != entry->retain);
+    }
+    k_mutex_unlock(&SessionLock);
+
+    return (message_id);
+}
+
+int64_t mqtt_session_flush_deadline(mqtt_session_t *session) {
+    return (session->flush_at);
+}
+
+void mqtt_session_flush(mqtt_session_t *session) {
+    k_mutex_lock(&SessionLock, K_FOREVER);
+    if (NULL == session->fs) {
+        session->dirty = 0U;
+    }
+
+    for (int32_t i = 0; i < MQTT_SESSION_MAX_UNACKED && 0U != session->dirty;
+         i++) {
+        mqtt_session_entry_t *entry = &session->entries[i];
+        ssize_t rc = 0;
+
+        if (0U == (session->dirty & BIT(i))) {
+            continue;
+        }
+
+        if (0U != entry->message_id) {
+            rc = nvs_write(session->fs, SESSION_ENTRY_ID(session, i), entry,
+                           SESSION_ENTRY_HDR_LEN + entry->topic_len +
+                               entry->payload_len);
+        } else {
+            rc = nvs_delete(session->fs, SESSION_ENTRY_ID(session, i));
+        }
+        if (0 > rc) {
+            /* kept dirty, next flush tries again */
+            LOG_ERR("Failed to flush entry %d, err %d", i, (int32_t)rc);
+            continue;
+        }
+
+        if (0U != entry->message_id) {
+            session->in_flash |= BIT(i);
+        } else {
+            session->in_flash &= ~BIT(i);
+        }
+        session->dirty &= ~BIT(i);
+    }
+
+    session->flush_at =
+        (0U == session->dirty)
+            ? INT64_MAX
+            : k_uptime_get() + MQTT_SESSION_FLUSH_PERIOD * MSEC_PER_SEC;
+    k_mutex_unlock(&SessionLock);
+}
+
+/* Must be called with SessionLock held */
+static int32_t session_find(mqtt_session_t *session, uint16_t message_id) {
+    for (int32_t i = 0; i < MQTT_SESSION_MAX_UNACKED; i++) {
+        if (message_id == session->entries[i].message_id) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* Must be called with SessionLock held. Entry released before it reached
+ * flash needs no flash access at all. */
+static void session_dirty_set(mqtt_session_t *session, int32_t idx) {
+    if (0U == session->entries[idx].message_id &&
+        0U == (session->in_flash & BIT(idx))) {
+        session->dirty &= ~BIT(idx);
+    } else {
+        session->dirty |= BIT(idx);
+    }
+
+    if (0U != session->dirty && INT64_MAX == session->flush_at) {
+        session->flush_at =
+            k_uptime_get() + MQTT_SESSION_FLUSH_PERIOD * MSEC_PER_SEC;
+    }
+}
+
+static void session_meta_save(mqtt_session_t *session) {
+    if (NULL == session->fs) {
+        return;
+    }
+
+    ssize_t rc = nvs_write(session->fs, SESSION_META_ID(session),
+                           &session->meta, sizeof(session->meta));
+    if (0 > rc) {
+        LOG_ERR("Failed to save session meta, err %d", (int32_t)rc);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,215 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: mqtt_stats.c
+ * --------------------------------------------------------------------------*/
+#include "mqtt_stats.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+static uint64_t state_ms_get(const mqtt_stats_t *stats, int32_t state);
+static void dispatch_hist_get(const mqtt_stats_t *stats,
+                              mqtt_stats_hist_t *hist);
+#if defined(CONFIG_SHELL)
+static void hist_print(const mqtt_stats_hist_t *hist, const char *name,
+                       const struct shell *sh);
+#endif
+
+static const char *const CounterKeys[] = {
+    "pub", "ack", "nack", "tmo", "stor", "rx", "drop", "lost", "wake",
+};
+BUILD_ASSERT(ARRAY_SIZE(CounterKeys) == MQTT_STATS_COUNTERS,
+             "Key missing for stats counter");
+
+void mqtt_stats_init(mqtt_stats_t *stats, const char *const *state_names,
+                     int32_t state_cnt, int32_t state) {
+    memset(stats, 0, sizeof(*stats));
+    stats->state_names = state_names;
+    stats->state_cnt = MIN(state_cnt, MQTT_STATS_MAX_STATES);
+
+    for (int32_t i = 0; i < stats->state_cnt; i++) {
+        snprintf(stats->state_keys[i][0], MQTT_STATS_STATE_KEY, "t_%s",
+                 state_names[i]);
+        snprintf(stats->state_keys[i][1], MQTT_STATS_STATE_KEY, "n_%s",
+                 state_names[i]);
+    }
+
+    stats->state = state;
+    stats->state_since = k_uptime_get();
+    stats->state_enter[state]++;
+}
+
+void mqtt_stats_state_set(mqtt_stats_t *stats, int32_t state) {
+    if (state == stats->state) {
+        return;
+    }
+
+    int64_t uptime_ms = k_uptime_get();
+    stats->state_ms[stats->state] += uptime_ms - stats->state_since;
+    stats->state_enter[state]++;
+    stats->state_since = uptime_ms;
+    stats->state = state;
+}
+
+void mqtt_stats_hist_add(mqtt_stats_hist_t *hist, int64_t ticks) {
+    uint64_t us = k_ticks_to_us_floor64(MAX(ticks, 0));
+    uint32_t sample = (uint32_t)MIN(us, UINT32_MAX);
+
+    /* bit width of the sample is its bucket */
+    uint32_t idx = MIN(find_msb_set(sample), MQTT_STATS_HIST_BUCKETS - 1);
+    hist->bucket[idx]++;
+    hist->count++;
+    hist->max = MAX(hist->max, sample);
+}
+
+void mqtt_stats_hist_merge(mqtt_stats_hist_t *dst,
+                           const mqtt_stats_hist_t *src) {
+    for (int32_t i = 0; i < MQTT_STATS_HIST_BUCKETS; i++) {
+        dst->bucket[i] += src->bucket[i];
+    }
+    dst->count += src->count;
+    dst->max = MAX(dst->max, src->max);
+}
+
+uint32_t mqtt_stats_hist_percentile(const mqtt_stats_hist_t *hist,
+                                    uint32_t pct) {
+    uint32_t rank = MAX(((uint64_t)hist->count * pct + 99) / 100, 1);
+    uint32_t sum = 0;
+
+    if (0 == hist->count) {
+        return (0);
+    }
+
+    for (int32_t i = 0; i < MQTT_STATS_HIST_BUCKETS - 1; i++) {
+        sum += hist->bucket[i];
+        if (sum >= rank) {
+            return (MIN(BIT(i), hist->max));
+        }
+    }
+    return (hist->max);
+}
+
+void mqtt_stats_max_update(atomic_t *max, atomic_val_t value) {
+    atomic_val_t old = atomic_get(max);
+
+    while (value > old && !atomic_cas(max, old, value)) {
+        old = atomic_get(max);
+    }
+}
+
+int32_t mqtt_stats_encode(const mqtt_stats_t *stats, mqtt_stats_part_t part,
+                          const payload_field_t *extra, size_t extra_cnt,
+                          uint8_t *buf, size_t size) {
+    payload_field_t fields[MAX(MQTT_STATS_COUNTERS + 4 + MQTT_STATS_EXTRA_MAX,
+                               2 * MQTT_STATS_MAX_STATES)];
+    mqtt_stats_hist_t dispatch;
+    size_t cnt = 0;
+
+    if (MQTT_STATS_EXTRA_MAX < extra_cnt) {
+        return (-EINVAL);
+    }
+
+    if (MQTT_STATS_PART_STATES == part) {
+        for (int32_t i = 0; i < stats->state_cnt; i++) {
+            fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+                stats->state_keys[i][0],
+                state_ms_get(stats, i) / MSEC_PER_SEC);
+            fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+                stats->state_keys[i][1], stats->state_enter[i]);
+        }
+        return (payload_cbor_encode(fields, cnt, buf, size));
+    }
+
+    for (int32_t i = 0; i < MQTT_STATS_COUNTERS; i++) {
+        fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+            CounterKeys[i], atomic_get(&stats->counter[i]));
+    }
+
+    dispatch_hist_get(stats, &dispatch);
+    fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+        "ack50", mqtt_stats_hist_percentile(&stats->puback, 50));
+    fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+        "ack99", mqtt_stats_hist_percentile(&stats->puback, 99));
+    fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+        "rx50", mqtt_stats_hist_percentile(&dispatch, 50));
+    fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+        "rx99", mqtt_stats_hist_percentile(&dispatch, 99));
+
+    for (size_t i = 0; i < extra_cnt; i++) {
+        if (PAYLOAD_FIELD_INT != extra[i].type ||
+            MQTT_STATS_KEY_MAX < strlen(extra[i].key)) {
+            return (-EINVAL);
+        }
+        fields[cnt++] = extra[i];
+    }
+
+    return (payload_cbor_encode(fields, cnt, buf, size));
+}
+
+#if defined(CONFIG_SHELL)
+void mqtt_stats_print(const mqtt_stats_t *stats, const struct shell *sh) {
+    mqtt_stats_hist_t dispatch;
+
+    for (int32_t i = 0; i < MQTT_STATS_COUNTERS; i++) {
+        shell_print(sh, "  %-5s %u", CounterKeys[i],
+                    (uint32_t)atomic_get(&stats->counter[i]));
+    }
+
+    for (int32_t i = 0; i < stats->state_cnt; i++) {
+        shell_print(sh, "  %-12s %u times, %llu ms%s", stats->state_names[i],
+                    stats->state_enter[i], state_ms_get(stats, i),
+                    (i == stats->state) ? " (now)" : "");
+    }
+
+    hist_print(&stats->puback, "publish-puback", sh);
+    dispatch_hist_get(stats, &dispatch);
+    hist_print(&dispatch, "receive-handler", sh);
+}
+
+static void hist_print(const mqtt_stats_hist_t *hist, const char *name,
+                       const struct shell *sh) {
+    shell_print(sh, "  %s: %u samples, p50 %u us, p99 %u us, max %u us", name,
+                hist->count, mqtt_stats_hist_percentile(hist, 50),
+                mqtt_stats_hist_percentile(hist, 99), hist->max);
+
+    for (int32_t i = 0; i < MQTT_STATS_HIST_BUCKETS; i++) {
+        if (0 == hist->bucket[i]) {
+            continue;
+        }
+        if (MQTT_STATS_HIST_BUCKETS - 1 == i) {
+            shell_print(sh, "    >= %8lu us %u", BIT(i - 1), hist->bucket[i]);
+        } else {
+            shell_print(sh, "    <  %8lu us %u", BIT(i), hist->bucket[i]);
+        }
+    }
+}
+#endif
+
+/* Includes time spent in current state so far */
+static uint64_t state_ms_get(const mqtt_stats_t *stats, int32_t state) {
+    uint64_t ms = stats->state_ms[state];
+
+    if (state == stats->state) {
+        ms += k_uptime_get() - stats->state_since;
+    }
+    return (ms);
+}
+
+static void dispatch_hist_get(const mqtt_stats_t *stats,
+                              mqtt_stats_hist_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+    for (int32_t i = 0; i < MQTT_STATS_DISPATCH_HISTS; i++) {
+        mqtt_stats_hist_merge(hist, &stats->dispatch[i]);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
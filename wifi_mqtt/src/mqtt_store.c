@@ -0,0 +1,223 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: mqtt_store.c
+ * --------------------------------------------------------------------------*/
+#include "mqtt_store.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "nvs_storage.h"
+
+LOG_MODULE_REGISTER(MQTT_STORE, CONFIG_APP_MQTT_STORE_LOG_LEVEL);
+
+#define STORE_RECORD_HDR_LEN (offsetof(mqtt_store_record_t, data))
+#define STORE_META_ID(store)                                                   \
+    ((store)->id_offset + NVS_STORAGE_ID_MQTT_STORE_META)
+#define STORE_RECORD_ID(store, seq)                                            \
+    ((store)->id_offset + NVS_STORAGE_ID_MQTT_STORE_BASE +                     \
+     ((seq) % MQTT_STORE_CAPACITY))
+
+static bool store_record_exists(mqtt_store_t *store, uint32_t seq);
+static void store_record_delete(mqtt_store_t *store, uint32_t seq);
+static void store_meta_save(mqtt_store_t *store);
+static void store_inflight_done(mqtt_store_t *store);
+
+/* Shared by all instances, also guards scratch records */
+K_MUTEX_DEFINE(StoreLock);
+
+int32_t mqtt_store_init(mqtt_store_t *store, struct nvs_fs *fs,
+                        uint16_t id_offset) {
+    int32_t rc = 0;
+
+    k_mutex_lock(&StoreLock, K_FOREVER);
+    store->fs = fs;
+    store->id_offset = id_offset;
+    if (NULL == store->fs) {
+        LOG_WRN("No storage, offline messages will be dropped");
+        rc = -ENODEV;
+        goto init_done;
+    }
+
+    rc = nvs_read(store->fs, STORE_META_ID(store), &store->meta,
+                  sizeof(store->meta));
+    if (sizeof(store->meta) != rc) {
+        LOG_INF("No store meta found, start empty log");
+        store->meta.head = 0;
+        store->meta.tail = 0;
+    }
+
+    /* skip records acked just before reboot, meta was not updated yet */
+    while (store->meta.tail != store->meta.head &&
+           !store_record_exists(store, store->meta.tail)) {
+        store->meta.tail++;
+    }
+    store->send_seq = store->meta.tail;
+    store->inflight = 0;
+    store->rewind = false;
+    LOG_INF("Store restored, %u records pending",
+            store->meta.head - store->meta.tail);
+    rc = 0;
+
+init_done:
+    k_mutex_unlock(&StoreLock);
+    return (rc);
+}
+
+int32_t mqtt_store_append(mqtt_store_t *store, const char *topic,
+                          uint16_t topic_len, const uint8_t *payload,
+                          uint16_t payload_len) {
+    static mqtt_store_record_t rec;
+    int32_t rc = 0;
+
+    if (MQTT_STORE_DATA_LEN < (topic_len + payload_len)) {
+        return (-EMSGSIZE);
+    }
+
+    k_mutex_lock(&StoreLock, K_FOREVER);
+    if (NULL == store->fs) {
+        rc = -ENODEV;
+        goto append_done;
+    }
+
+    if (MQTT_STORE_CAPACITY <= (store->meta.head - store->meta.tail)) {
+        LOG_WRN("Store full, drop record %u", store->meta.tail);
+        store_record_delete(store, store->meta.tail);
+        store->meta.tail++;
+        if ((int32_t)(store->send_seq - store->meta.tail) < 0) {
+            store->send_seq = store->meta.tail;
+        }
+    }
+
+    rec.seq = store->meta.head;
+    rec.topic_len = topic_len;
+    rec.payload_len = payload_len;
+    memcpy(rec.data, topic, topic_len);
+    memcpy(rec.data + topic_len, payload, payload_len);
+
+    size_t rec_len = STORE_RECORD_HDR_LEN + topic_len + payload_len;
+    rc = nvs_write(store->fs, STORE_RECORD_ID(store, rec.seq), &rec, rec_len);
+    if (0 > rc) {
+        LOG_ERR("Store record %u write err %d", rec.seq, rc);
+        goto append_done;
+    }
+
+    store->meta.head++;
+    store_meta_save(store);
+    rc = rec.seq;
+
+append_done:
+    k_mutex_unlock(&StoreLock);
+    return (rc);
+}
+
+int32_t mqtt_store_next(mqtt_store_t *store, mqtt_store_record_t *rec) {
+    int32_t rc = -ENOENT;
+
+    k_mutex_lock(&StoreLock, K_FOREVER);
+    if (store->rewind) {
+        /* would be sent again after the rewind */
+        rc = -EBUSY;
+        goto next_done;
+    }
+
+    while (NULL != store->fs && store->send_seq != store->meta.head) {
+        uint32_t seq = store->send_seq++;
+        ssize_t len =
+            nvs_read(store->fs, STORE_RECORD_ID(store, seq), rec, sizeof(*rec));
+
+        /* Missing record was already acked, other seq is a stale record left
+         * from previous lap of the ring. Both must not be replayed. */
+        if (STORE_RECORD_HDR_LEN <= len && seq == rec->seq) {
+            store->inflight++;
+            rc = 0;
+            break;
+        }
+    }
+
+next_done:
+    k_mutex_unlock(&StoreLock);
+
+    return (rc);
+}
+
+void mqtt_store_ack(mqtt_store_t *store, uint32_t seq) {
+    k_mutex_lock(&StoreLock, K_FOREVER);
+    if (NULL == store->fs) {
+        goto ack_done;
+    }
+
+    /* ring may already hold newer record under the same id */
+    if (store_record_exists(store, seq)) {
+        store_record_delete(store, seq);
+    }
+    if (seq == store->meta.tail) {
+        while (store->meta.tail != store->meta.head &&
+               !store_record_exists(store, store->meta.tail)) {
+            store->meta.tail++;
+        }
+        store_meta_save(store);
+    }
+
+ack_done:
+    store_inflight_done(store);
+    k_mutex_unlock(&StoreLock);
+}
+
+void mqtt_store_fail(mqtt_store_t *store, uint32_t seq) {
+    k_mutex_lock(&StoreLock, K_FOREVER);
+    LOG_DBG("Store record %u not delivered", seq);
+    store->rewind = true;
+    store_inflight_done(store);
+    k_mutex_unlock(&StoreLock);
+}
+
+uint32_t mqtt_store_count(mqtt_store_t *store) {
+    k_mutex_lock(&StoreLock, K_FOREVER);
+    uint32_t count = store->meta.head - store->meta.tail;
+    k_mutex_unlock(&StoreLock);
+    return (count);
+}
+
+static bool store_record_exists(mqtt_store_t *store, uint32_t seq) {
+    mqtt_store_record_t hdr;
+
+    /* nvs_read() copies only header but returns full item length */
+    ssize_t len = nvs_read(store->fs, STORE_RECORD_ID(store, seq), &hdr,
+                           STORE_RECORD_HDR_LEN);
+    return (STORE_RECORD_HDR_LEN <= len && seq == hdr.seq);
+}
+
+static void store_record_delete(mqtt_store_t *store, uint32_t seq) {
+    int32_t rc = nvs_delete(store->fs, STORE_RECORD_ID(store, seq));
+    if (0 != rc) {
+        LOG_ERR("Store record %u delete err %d", seq, rc);
+    }
+}
+
+/* Must be called with StoreLock held */
+static void store_inflight_done(mqtt_store_t *store) {
+    if (0 < store->inflight) {
+        store->inflight--;
+    }
+    if (store->rewind && 0 == store->inflight) {
+        store->send_seq = store->meta.tail;
+        store->rewind = false;
+    }
+}
+
+static void store_meta_save(mqtt_store_t *store) {
+    int32_t rc = nvs_write(store->fs, STORE_META_ID(store), &store->meta,
+                           sizeof(store->meta));
+    if (0 > rc) {
+        LOG_ERR("Store meta write err %d", rc);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
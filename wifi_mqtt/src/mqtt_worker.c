@@ -5,6 +5,7 @@
  * --------------------------------------------------------------------------*/
 #include "mqtt_worker.h"
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,229 +14,1545 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/net/mqtt.h>
 #include <zephyr/net/socketutils.h>
+#if defined(CONFIG_EVENTFD)
+#include <zephyr/posix/sys/eventfd.h>
+#endif
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS)
+#include <zephyr/sys/sys_heap.h>
+#endif
+
+#include "backoff.h"
+#include "dns_cache.h"
+#include "mqtt_session.h"
+#include "mqtt_stats.h"
+#include "mqtt_store.h"
+#include "nvs_storage.h"
+#include "topic_router.h"
+
+LOG_MODULE_REGISTER(MQTT, CONFIG_APP_MQTT_WORKER_LOG_LEVEL);
+
+typedef enum publish_slot_state {
+    SLOT_FREE,
+    SLOT_RESERVED, /* owned by publisher, being filled */
+    SLOT_QUEUED,   /* waiting in publish queue for network thread */
+    SLOT_INFLIGHT, /* sent, waiting for PUBACK */
+    SLOT_DONE
+} publish_slot_state_t;
+
+typedef struct publish_slot {
+    publish_slot_state_t state;
+    uint16_t message_id;
+    int32_t result;
+    int64_t deadline;   /* of queued or inflight, network thread expires it */
+    int64_t sent_ticks; /* publish-puback latency */
+    bool blocking;      /* publisher waits on done semaphore */
+    bool stored;        /* record drained from offline store */
+    uint32_t store_seq; /* valid when stored */
+    bool resent;        /* session message sent again after reconnect */
+    bool retain;
+    publish_cb_t cb;
+    void *user_data;
+    struct k_sem done;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    const uint8_t *payload; /* buffer, or caller data of large publish */
+    char topic[MQTT_WORKER_MAX_TOPIC_LEN];
+    char buffer[MQTT_WORKER_MAX_PUBLISH_LEN];
+} publish_slot_t;
+
+/* PUBLISH fixed header, topic and packet id are encoded into tx buffer,
+ * payload is passed to the socket as separate iovec and never copied */
+BUILD_ASSERT(MQTT_WORKER_BUFFER_SIZE >= MQTT_WORKER_MAX_TOPIC_LEN + 16,
+             "MQTT buffer can not hold PUBLISH header");
+
+/* Requests from other threads, handled by network thread */
+#define REQUEST_CONNECT    (0)
+#define REQUEST_DISCONNECT (1)
+
+/* Without eventfd the socket wait can not be interrupted, so it is sliced */
+#define WAIT_SLICE_NO_EVENTFD (100) /* miliseconds */
+
+#define MQTT_NET_PRIORITY (5)
+
+typedef enum worker_state {
+    DNS_RESOLVE,
+    CONNECT_TO_BROKER,
+    SUBSCRIBE,
+    CONNECTED,
+    DISCONNECTED
+} worker_state_t;
+
+/* Stats names of worker_state_t */
+static const char *const StateNames[] = {
+    "dns", "connect", "subscribe", "connected", "offline",
+};
+BUILD_ASSERT(ARRAY_SIZE(StateNames) == DISCONNECTED + 1,
+             "Stats name missing for worker state");
+BUILD_ASSERT(ARRAY_SIZE(StateNames) <= MQTT_STATS_MAX_STATES,
+             "Too many worker states for stats");
+BUILD_ASSERT(MQTT_STATS_COUNTERS_LEN_MAX <= MQTT_WORKER_MAX_PUBLISH_LEN &&
+                 MQTT_STATS_STATES_LEN_MAX <= MQTT_WORKER_MAX_PUBLISH_LEN,
+             "Metrics do not fit CONFIG_APP_MQTT_MAX_PUBLISH_LEN");
+
+struct mqtt_worker {
+    struct mqtt_client client;
+    struct sockaddr_storage broker;
+    char hostname[32];
+    char port_str[8];
+    int32_t port;
+    int32_t index;
+
+    worker_state_t state;
+    enum mqtt_evt_type last_evt;
+    bool connected;
+    bool disconnect_req;
+    bool subscribed;
+    uint16_t subscribe_id; /* packet id of the last SUBSCRIBE */
+    int32_t subscribe_trials;
+    int64_t reconnect_at; /* uptime of next attempt after broker link loss */
+    atomic_t requests;
+    int64_t next_store_drain;
+    bool resending; /* session messages left to send again */
+
+    /* Dead link detection, ping_deadline is INT64_MAX when no ping sent */
+    int64_t last_rx_ms;
+    int64_t ping_deadline;
+
+    /* Received message waiting for room in its dispatch queue, socket is not
+     * read meanwhile. Set only with MQTT_WORKER_BACKPRESSURE, polled by
+     * dispatch threads. PUBACK of a held QoS1 message waits until it is
+     * queued, rx_held_ack is its packet id, 0 for QoS0. */
+    atomic_ptr_t rx_held;
+    uint16_t rx_held_ack;
+
+    /* Wakes network thread when waiting for request or for socket input */
+    struct k_poll_signal wakeup_signal;
+    int wakeup_fd;
+
+    /* Delay between failed DNS/connect attempts, reset once connected */
+    backoff_t backoff;
+
+    /* Topic filters with their handlers, also source of subscription list */
+    topic_router_t router;
+
+    /* Every in-flight QoS1 message owns one slot until its PUBACK arrives */
+    publish_slot_t slots[MQTT_WORKER_INFLIGHT_MAX];
+    struct k_sem slots_free;
+    struct k_mutex slots_lock;
+    struct k_msgq publish_queue;
+    uint16_t publish_queue_buf[MQTT_WORKER_INFLIGHT_MAX];
+    int32_t inflight_max; /* lowered by broker Receive Maximum */
+
+#if defined(CONFIG_MQTT_VERSION_5_0)
+    /* Topic aliases of current connection, alias is index + 1 */
+    int32_t alias_max;
+    int32_t alias_cnt;
+    uint16_t alias_len[MQTT_WORKER_TOPIC_ALIASES];
+    char alias_topic[MQTT_WORKER_TOPIC_ALIASES][MQTT_WORKER_MAX_TOPIC_LEN];
+#endif
+
+    mqtt_store_t store;
+    mqtt_store_record_t drain_rec;
+    struct k_fifo store_pending; /* store_pending_t to append to store */
+    mqtt_session_t session;
+    dns_cache_t dns;
+    mqtt_stats_t stats;
+#if defined(CONFIG_MQTT_LIB_TLS)
+    sec_tag_t sec_tag; /* referenced by tls config of the client */
+#endif
+
+    struct k_thread thread;
+};
+
+static void mqtt_evt_handler(struct mqtt_client *const client,
+                             const struct mqtt_evt *evt);
+static void connack_limits_set(mqtt_worker_t *worker,
+                               const struct mqtt_connack_param *connack);
+static int32_t wait_for_input(mqtt_worker_t *worker, int32_t timeout,
+                              bool wakeable);
+static void wait_for_request(mqtt_worker_t *worker, k_timeout_t timeout);
+static void worker_wakeup(mqtt_worker_t *worker);
+static int32_t worker_buffers_get(mqtt_worker_t *worker);
+static void worker_buffers_put(mqtt_worker_t *worker);
+static int32_t input_timeout(mqtt_worker_t *worker);
+static void keepalive_ping(mqtt_worker_t *worker, const char *reason);
+static int64_t keepalive_next(mqtt_worker_t *worker);
+static int32_t keepalive_process(mqtt_worker_t *worker);
+static int32_t dns_resolve(mqtt_worker_t *worker);
+static int32_t connect_to_broker(mqtt_worker_t *worker);
+static int32_t input_handle(mqtt_worker_t *worker);
+static int32_t mqtt_worker_subscribe(mqtt_worker_t *worker);
+static int32_t publish_blocking_begin(mqtt_worker_t *worker, const char *topic,
+                                      publish_slot_t **slot);
+static int32_t publish_blocking_end(mqtt_worker_t *worker, publish_slot_t *slot,
+                                    int32_t res);
+static publish_slot_t *publish_slot_get(mqtt_worker_t *worker,
+                                        k_timeout_t timeout);
+static void publish_slot_put(mqtt_worker_t *worker, publish_slot_t *slot);
+static int32_t publish_slot_topic_set(publish_slot_t *slot, const char *topic,
+                                      uint16_t topic_len);
+static void publish_slot_state_set(mqtt_worker_t *worker, publish_slot_t *slot,
+                                   publish_slot_state_t state);
+static void publish_slot_queue(mqtt_worker_t *worker, publish_slot_t *slot);
+static int32_t publish_slot_send(mqtt_worker_t *worker, publish_slot_t *slot);
+static bool publish_slot_inflight_try(mqtt_worker_t *worker,
+                                      publish_slot_t *slot);
+static bool publish_slot_resolve(publish_slot_t *slot, int32_t result);
+static void publish_slot_notify(mqtt_worker_t *worker, publish_slot_t *slot);
+static bool publish_slot_complete(mqtt_worker_t *worker, uint16_t message_id,
+                                  int32_t result);
+static void publish_slots_abort(mqtt_worker_t *worker, int32_t result);
+static int32_t publish_slots_expire(mqtt_worker_t *worker);
+static int64_t publish_slots_next_deadline(mqtt_worker_t *worker);
+static void publish_queue_process(mqtt_worker_t *worker);
+static int32_t publish_enqueue(mqtt_worker_t *worker, const char *topic,
+                               uint16_t topic_len, const uint8_t *payload,
+                               uint16_t payload_len, publish_cb_t cb,
+                               void *user_data, const uint32_t *store_seq);
+static int32_t publish_store(mqtt_worker_t *worker, const char *topic,
+                             uint16_t topic_len, const uint8_t *payload,
+                             uint16_t payload_len);
+static int32_t publish_store_defer(mqtt_worker_t *worker, const char *topic,
+                                   uint16_t topic_len, const uint8_t *payload,
+                                   uint16_t payload_len);
+static void publish_store_pending(mqtt_worker_t *worker);
+static void publish_store_drain(mqtt_worker_t *worker);
+static void session_resend_drain(mqtt_worker_t *worker);
+#if defined(CONFIG_MQTT_VERSION_5_0)
+static bool topic_alias_apply(mqtt_worker_t *worker,
+                              struct mqtt_publish_param *pub);
+#endif
+
+static void mqtt_proc(void *, void *, void *);
+static void dispatch_proc(void *, void *, void *);
+static void dispatch_start(void);
+static struct k_msgq *dispatch_queue(const mqtt_worker_msg_t *msg);
+static int32_t subs_dispatch(mqtt_worker_t *worker, mqtt_worker_msg_t *msg,
+                             mqtt_worker_overflow_t overflow);
+static bool subs_held_retry(mqtt_worker_t *worker);
+static int32_t subs_receive(mqtt_worker_t *worker,
+                            const struct mqtt_publish_param *pub);
+static void subs_held_drop(mqtt_worker_t *worker);
+static void subs_ack(mqtt_worker_t *worker, uint16_t message_id);
+static mqtt_worker_msg_t *subs_msg_alloc(mqtt_worker_t *worker,
+                                         const struct mqtt_publish_param *pub,
+                                         const subs_cb_t *handlers,
+                                         int32_t handler_cnt);
+static void subs_payload_discard(struct mqtt_client *client, int32_t len);
+static size_t shared_stats_fields(payload_field_t *fields);
+static size_t worker_stats_fields(mqtt_worker_t *worker,
+                                  payload_field_t *fields);
+
+static mqtt_worker_t Workers[MQTT_WORKER_MAX_INSTANCES];
+static int32_t WorkersCnt = 0;
+
+K_THREAD_STACK_ARRAY_DEFINE(WorkerStacks, MQTT_WORKER_MAX_INSTANCES,
+                            MQTT_WORKER_STACK_SIZE);
+
+/* Incoming messages of all instances, each dispatch thread has its queue */
+#define DISPATCH_PRIORITY (5)
+#define DISPATCH_RETRY    (10) /* miliseconds, held message put again */
+K_THREAD_STACK_ARRAY_DEFINE(DispatchStacks, MQTT_WORKER_DISPATCH_THREADS,
+                            MQTT_WORKER_DISPATCH_STACK_SIZE);
+static struct k_thread DispatchThreads[MQTT_WORKER_DISPATCH_THREADS];
+static struct k_msgq DispatchQueues[MQTT_WORKER_DISPATCH_THREADS];
+/* Taken to remove from a queue, so eviction takes the message it checked */
+static struct k_mutex DispatchLocks[MQTT_WORKER_DISPATCH_THREADS];
+static mqtt_worker_msg_t *DispatchQueueBufs[MQTT_WORKER_DISPATCH_THREADS]
+                                           [MQTT_WORKER_DISPATCH_QUEUE_LEN];
+
+K_HEAP_DEFINE(SubsHeap, MQTT_WORKER_SUBS_HEAP_SIZE);
+
+/* Offline publish waiting for the network thread to write it to flash */
+typedef struct store_pending {
+    void *fifo_reserved;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    uint8_t data[]; /* topic followed by payload */
+} store_pending_t;
+K_HEAP_DEFINE(StorePendingHeap,
+              MQTT_WORKER_STORE_PENDING *
+                  (sizeof(store_pending_t) + MQTT_WORKER_MAX_TOPIC_LEN +
+                   MQTT_WORKER_MAX_PUBLISH_LEN + 16));
+K_HEAP_DEFINE(BufferPool, MQTT_WORKER_BUFFER_POOL_SIZE);
+K_MUTEX_DEFINE(RouterLock);
+
+static atomic_t DispatchQueueMax; /* high-water mark of dispatch queues */
+static atomic_t WakeAlignMs;      /* see mqtt_worker_wake_align() */
+
+void mqtt_worker_msg_release(mqtt_worker_msg_t *msg) {
+    /* freed when the last matching handler is done */
+    if (1 == atomic_dec(&msg->ref)) {
+        k_heap_free(&SubsHeap, msg);
+    }
+}
+
+int32_t mqtt_worker_subscribe_topic(mqtt_worker_t *worker, const char *filter,
+                                    enum mqtt_qos qos, subs_cb_t cb,
+                                    mqtt_worker_overflow_t overflow) {
+    /* QoS2 receive handshake is not implemented */
+    if (MQTT_QOS_1_AT_LEAST_ONCE < qos) {
+        LOG_ERR("Filter %s, QoS %d not supported", filter, qos);
+        return (-ENOTSUP);
+    }
+
+    k_mutex_lock(&RouterLock, K_FOREVER);
+    int32_t res =
+        topic_router_add(&worker->router, filter, qos, cb, overflow);
+    k_mutex_unlock(&RouterLock);
+
+    if (0 != res) {
+        LOG_ERR("Cannot register filter %s, err %d", filter, res);
+    }
+    return (res);
+}
+
+bool mqtt_worker_connected(mqtt_worker_t *worker) {
+    return (CONNECTED == worker->state);
+}
+
+void mqtt_worker_disconnect(void) {
+    for (int32_t i = 0; i < WorkersCnt; i++) {
+        mqtt_worker_t *worker = &Workers[i];
+        worker->disconnect_req = true;
+        atomic_set_bit(&worker->requests, REQUEST_DISCONNECT);
+        worker_wakeup(worker);
+    }
+}
+
+void mqtt_worker_wake_align(uint32_t period_ms) {
+    atomic_set(&WakeAlignMs, period_ms);
+    LOG_INF("Timed wakeups aligned to %u ms", period_ms);
+}
+
+void mqtt_worker_connection_attempt(void) {
+    for (int32_t i = 0; i < WorkersCnt; i++) {
+        atomic_set_bit(&Workers[i].requests, REQUEST_CONNECT);
+        worker_wakeup(&Workers[i]);
+    }
+}
+
+int32_t mqtt_worker_publish_qos1(mqtt_worker_t *worker, const char *topic,
+                                 const char *fmt, ...) {
+    int32_t res = 0;
+    publish_slot_t *slot = NULL;
+
+    va_list args;
+    va_start(args, fmt);
+
+    res = publish_blocking_begin(worker, topic, &slot);
+    if (0 != res) {
+        goto failed_done;
+    }
+
+    int32_t len = vsnprintf(slot->buffer, sizeof(slot->buffer), fmt, args);
+    if (0 > len) {
+        LOG_ERR("Publish format failed");
+        res = -EINVAL;
+    } else if ((int32_t)sizeof(slot->buffer) <= len) {
+        /* truncated message would be acked as if sent whole */
+        LOG_ERR("Publish payload to long %d", len);
+        res = -EMSGSIZE;
+    } else {
+        slot->payload_len = len;
+    }
+
+    res = publish_blocking_end(worker, slot, res);
+
+failed_done:
+    va_end(args);
+    return (res);
+}
+
+int32_t mqtt_worker_publish_cbor(mqtt_worker_t *worker, const char *topic,
+                                 const payload_field_t *fields, size_t cnt) {
+    publish_slot_t *slot = NULL;
+
+    int32_t res = publish_blocking_begin(worker, topic, &slot);
+    if (0 != res) {
+        goto failed_done;
+    }
+
+    /* slot buffer is what mqtt_publish() sends, no intermediate copy */
+    int32_t len = payload_cbor_encode(fields, cnt, (uint8_t *)slot->buffer,
+                                      sizeof(slot->buffer));
+    if (0 > len) {
+        LOG_ERR("Publish encode failed, err %d", len);
+        res = len;
+    } else {
+        slot->payload_len = len;
+    }
+
+    res = publish_blocking_end(worker, slot, res);
+
+failed_done:
+    return (res);
+}
+
+int32_t mqtt_worker_publish_large(mqtt_worker_t *worker, const char *topic,
+                                  const uint8_t *payload,
+                                  uint16_t payload_len) {
+    publish_slot_t *slot = NULL;
+
+    int32_t res = publish_blocking_begin(worker, topic, &slot);
+    if (0 != res) {
+        goto failed_done;
+    }
+
+    /* caller keeps the data until the ack, socket reads it in place */
+    slot->payload = payload;
+    slot->payload_len = payload_len;
+
+    res = publish_blocking_end(worker, slot, 0);
+
+failed_done:
+    return (res);
+}
+
+int32_t mqtt_worker_publish_async(mqtt_worker_t *worker, const char *topic,
+                                  const uint8_t *payload, uint16_t payload_len,
+                                  publish_cb_t cb, void *user_data) {
+    int32_t res = 0;
+    size_t topic_len = strlen(topic);
+
+    if (MQTT_WORKER_MAX_TOPIC_LEN < topic_len) {
+        LOG_ERR("Publish topic to long %zu", topic_len);
+        res = -EMSGSIZE;
+        goto failed_done;
+    }
+
+    if (MQTT_WORKER_MAX_PUBLISH_LEN < payload_len) {
+        LOG_ERR("Publish payload to long %u", payload_len);
+        res = -EMSGSIZE;
+        goto failed_done;
+    }
+
+    if (!worker->connected || worker->disconnect_req) {
+        res = publish_store_defer(worker, topic, topic_len, payload,
+                                  payload_len);
+        goto failed_done;
+    }
+
+    res = publish_enqueue(worker, topic, topic_len, payload, payload_len, cb,
+                          user_data, NULL);
+
+failed_done:
+    return (res);
+}
+
+int32_t mqtt_worker_stats_encode(mqtt_worker_t *worker,
+                                 mqtt_stats_part_t part, uint8_t *buf,
+                                 size_t size) {
+    payload_field_t extra[MQTT_STATS_EXTRA_MAX];
+    size_t cnt = worker_stats_fields(worker, extra);
+
+    cnt += shared_stats_fields(extra + cnt);
+    return (mqtt_stats_encode(&worker->stats, part, extra, cnt, buf, size));
+}
+
+int32_t mqtt_worker_stats_publish(mqtt_worker_t *worker,
+                                  mqtt_stats_part_t part, const char *topic) {
+    publish_slot_t *slot = NULL;
+
+    int32_t res = publish_blocking_begin(worker, topic, &slot);
+    if (0 != res) {
+        goto failed_done;
+    }
+
+    int32_t len = mqtt_worker_stats_encode(
+        worker, part, (uint8_t *)slot->buffer, sizeof(slot->buffer));
+    if (0 > len) {
+        LOG_ERR("Stats encode failed, err %d", len);
+        res = len;
+    } else {
+        slot->payload_len = len;
+    }
+
+    res = publish_blocking_end(worker, slot, res);
+
+failed_done:
+    return (res);
+}
+
+#if defined(CONFIG_MQTT_LIB_TLS)
+int32_t mqtt_worker_tls_set(mqtt_worker_t *worker, sec_tag_t sec_tag) {
+    struct mqtt_sec_config *tls = &worker->client.transport.tls.config;
+
+    if (DISCONNECTED != worker->state) {
+        LOG_ERR("TLS must be set while disconnected");
+        return (-EBUSY);
+    }
+
+    worker->sec_tag = sec_tag;
+    worker->client.transport.type = MQTT_TRANSPORT_SECURE;
+
+    tls->peer_verify = TLS_PEER_VERIFY_REQUIRED;
+    tls->cipher_list = NULL;
+    tls->cipher_count = 0;
+    tls->sec_tag_list = &worker->sec_tag;
+    tls->sec_tag_count = 1;
+    tls->hostname = worker->hostname; /* SNI and certificate check */
+
+    /* Socket layer keeps the negotiated session per peer address. Next
+     * connect to the same address, which dns cache offers first, resumes it
+     * with an abbreviated handshake instead of full key exchange. */
+    tls->session_cache = TLS_SESSION_CACHE_ENABLED;
+
+    LOG_INF("TLS enabled, sec tag %d", sec_tag);
+    return (0);
+}
+#endif
+
+mqtt_worker_t *mqtt_worker_init(const char *hostname, int32_t port) {
+    if (MQTT_WORKER_MAX_INSTANCES <= WorkersCnt) {
+        LOG_ERR("No free worker instance for %s", hostname);
+        return (NULL);
+    }
+
+    if (0 == WorkersCnt) {
+        dispatch_start();
+    }
+
+    mqtt_worker_t *worker = &Workers[WorkersCnt];
+    struct mqtt_client *client = &worker->client;
+    struct nvs_fs *fs = nvs_storage_get();
+    uint16_t nvs_offset = WorkersCnt * NVS_STORAGE_ID_INSTANCE_STRIDE;
+
+    worker->index = WorkersCnt;
+    strncpy(worker->hostname, hostname, sizeof(worker->hostname) - 1);
+    worker->port = port;
+    snprintf(worker->port_str, sizeof(worker->port_str), "%d", port);
+
+    worker->state = DISCONNECTED;
+    worker->next_store_drain = INT64_MIN;
+    worker->ping_deadline = INT64_MAX;
+    worker->wakeup_fd = -1;
+    worker->backoff =
+        (backoff_t)BACKOFF_INITIALIZER(worker->hostname, 1000, 60000);
+
+    mqtt_stats_init(&worker->stats, StateNames, ARRAY_SIZE(StateNames),
+                    DISCONNECTED);
+    mqtt_session_init(&worker->session, fs, nvs_offset);
+    mqtt_client_init(client);
+
+    /* MQTT client configuration */
+    client->broker = &worker->broker;
+    client->evt_cb = mqtt_evt_handler;
+#if defined(CONFIG_MQTT_VERSION_5_0)
+    client->protocol_version = MQTT_VERSION_5_0;
+#else
+    client->protocol_version = MQTT_VERSION_3_1_1;
+#endif
+    client->client_id.utf8 =
+        (uint8_t *)mqtt_session_client_id(&worker->session);
+    client->client_id.size = strlen(mqtt_session_client_id(&worker->session));
+    client->clean_session = MQTT_WORKER_PERSISTENT_SESSION ? 0U : 1U;
+    client->password = NULL;
+    client->user_name = NULL;
+    client->keepalive = MQTT_WORKER_KEEPALIVE;
+
+    /* rx and tx buffers are taken from BufferPool for each connection */
+    client->rx_buf = NULL;
+    client->tx_buf = NULL;
+
+    mqtt_store_init(&worker->store, fs, nvs_offset);
+    dns_cache_init(&worker->dns, fs, nvs_offset, worker->hostname);
+
+    k_fifo_init(&worker->store_pending);
+    k_poll_signal_init(&worker->wakeup_signal);
+#if defined(CONFIG_EVENTFD)
+    worker->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    if (0 > worker->wakeup_fd) {
+        LOG_ERR("Wakeup eventfd failed, err %d", errno);
+    }
+#endif
+
+    k_sem_init(&worker->slots_free, MQTT_WORKER_INFLIGHT_MAX,
+               MQTT_WORKER_INFLIGHT_MAX);
+    k_mutex_init(&worker->slots_lock);
+    worker->inflight_max = MQTT_WORKER_INFLIGHT_MAX;
+    k_msgq_init(&worker->publish_queue, (char *)worker->publish_queue_buf,
+                sizeof(uint16_t), MQTT_WORKER_INFLIGHT_MAX);
+    for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+        worker->slots[i].state = SLOT_FREE;
+        k_sem_init(&worker->slots[i].done, 0, 1);
+    }
+
+    k_tid_t tid = k_thread_create(
+        &worker->thread, WorkerStacks[worker->index],
+        K_THREAD_STACK_SIZEOF(WorkerStacks[worker->index]), mqtt_proc, worker,
+        NULL, NULL, MQTT_NET_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(tid, worker->hostname);
+
+    WorkersCnt++;
+    return (worker);
+}
+
+/* Reserve slot for publisher which waits for the ack, payload is written
+ * by the caller and handed over with publish_blocking_end() */
+static int32_t publish_blocking_begin(mqtt_worker_t *worker, const char *topic,
+                                      publish_slot_t **slot) {
+    *slot = publish_slot_get(worker,
+                             K_SECONDS(MQTT_WORKER_PUBLISH_ACK_TIMEOUT));
+    if (NULL == *slot) {
+        LOG_ERR("No free publish slot");
+        return (-ENOMEM);
+    }
+    (*slot)->blocking = true;
+
+    int32_t res = publish_slot_topic_set(*slot, topic, strlen(topic));
+    if (0 != res) {
+        publish_slot_put(worker, *slot);
+        *slot = NULL;
+    }
+    return (res);
+}
+
+/* Queue filled slot and wait for its ack, slot is released in any case.
+ * Nonzero res is an error of the payload fill, only the slot is released. */
+static int32_t publish_blocking_end(mqtt_worker_t *worker, publish_slot_t *slot,
+                                    int32_t res) {
+    if (0 != res) {
+        goto failed_done;
+    }
+
+    if (!worker->connected || worker->disconnect_req) {
+        res = publish_store(worker, slot->topic, slot->topic_len,
+                            slot->payload, slot->payload_len);
+        goto failed_done;
+    }
+
+    /* Client is used by network thread only, it sends the slot and resolves
+     * it by PUBACK, timeout or disconnect. Until then the slot is not
+     * touched here, so the publisher can not free it in the middle of send.
+     * Other slots stay free for concurrent publishers meanwhile. */
+    publish_slot_queue(worker, slot);
+    k_sem_take(&slot->done, K_FOREVER);
+    res = slot->result;
+
+failed_done:
+    publish_slot_put(worker, slot);
+    return (res);
+}
+
+static publish_slot_t *publish_slot_get(mqtt_worker_t *worker,
+                                        k_timeout_t timeout) {
+    publish_slot_t *slot = NULL;
+
+    if (0 != k_sem_take(&worker->slots_free, timeout)) {
+        goto failed_done;
+    }
+
+    /* may write flash, so taken before the lock */
+    uint16_t message_id = mqtt_session_message_id_next(&worker->session);
+
+    /* Holding one count of slots_free, so a free slot always exists */
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+        if (SLOT_FREE == worker->slots[i].state) {
+            slot = &worker->slots[i];
+            break;
+        }
+    }
+
+    slot->state = SLOT_RESERVED;
+    slot->result = -EINPROGRESS;
+    slot->blocking = false;
+    slot->stored = false;
+    slot->resent = false;
+    slot->retain = true;
+    slot->cb = NULL;
+    slot->user_data = NULL;
+    slot->payload = (uint8_t *)slot->buffer;
+    slot->message_id = message_id;
+    k_sem_reset(&slot->done);
+    k_mutex_unlock(&worker->slots_lock);
+
+failed_done:
+    return (slot);
+}
+
+static void publish_slot_put(mqtt_worker_t *worker, publish_slot_t *slot) {
+    publish_slot_state_set(worker, slot, SLOT_FREE);
+    k_sem_give(&worker->slots_free);
+}
+
+static int32_t publish_slot_topic_set(publish_slot_t *slot, const char *topic,
+                                      uint16_t topic_len) {
+    if (MQTT_WORKER_MAX_TOPIC_LEN < topic_len) {
+        LOG_ERR("Publish topic to long %u", topic_len);
+        return (-EMSGSIZE);
+    }
+
+    memcpy(slot->topic, topic, topic_len);
+    slot->topic_len = topic_len;
+    return (0);
+}
+
+static void publish_slot_state_set(mqtt_worker_t *worker, publish_slot_t *slot,
+                                   publish_slot_state_t state) {
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    slot->state = state;
+    k_mutex_unlock(&worker->slots_lock);
+}
+
+/* Hand slot over to network thread, queue has room for every slot */
+static void publish_slot_queue(mqtt_worker_t *worker, publish_slot_t *slot) {
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    slot->state = SLOT_QUEUED;
+    slot->deadline =
+        k_uptime_get() + (MQTT_WORKER_PUBLISH_ACK_TIMEOUT * MSEC_PER_SEC);
+    k_mutex_unlock(&worker->slots_lock);
+
+    k_msgq_put(&worker->publish_queue, &slot->message_id, K_NO_WAIT);
+    worker_wakeup(worker);
+}
+
+/* Called from network thread only */
+static int32_t publish_slot_send(mqtt_worker_t *worker, publish_slot_t *slot) {
+    struct mqtt_publish_param pub_data = {0};
+
+    pub_data.message.payload.data = (uint8_t *)slot->payload;
+    pub_data.message.payload.len = slot->payload_len;
+    pub_data.message.topic.topic.utf8 = (uint8_t *)slot->topic;
+    pub_data.message.topic.topic.size = slot->topic_len;
+    pub_data.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
+    pub_data.message_id = slot->message_id;
+    pub_data.dup_flag = slot->resent ? 1U : 0U;
+    pub_data.retain_flag = slot->retain ? 1U : 0U;
+
+    /* store records are already in flash until acked, resent messages are
+     * still tracked */
+    bool tracked = false;
+    if (MQTT_WORKER_PERSISTENT_SESSION && !slot->stored && !slot->resent) {
+        tracked = (0 == mqtt_session_track(&worker->session, slot->message_id,
+                                           slot->topic, slot->topic_len,
+                                           slot->payload, slot->payload_len,
+                                           slot->retain));
+    }
+
+    slot->sent_ticks = k_uptime_ticks();
+#if defined(CONFIG_MQTT_VERSION_5_0)
+    bool registered = topic_alias_apply(worker, &pub_data);
+#endif
+    int32_t res = mqtt_publish(&worker->client, &pub_data);
+#if defined(CONFIG_MQTT_VERSION_5_0)
+    if (0 != res && registered) {
+        worker->alias_cnt--; /* broker may not know it */
+    }
+#endif
+    if (0 != res && tracked) {
+        /* never left the device */
+        mqtt_session_release(&worker->session, slot->message_id);
+    }
+    if (0 == res) {
+        mqtt_stats_inc(&worker->stats, MQTT_STATS_PUBLISHED);
+    }
+
+    return (res);
+}
+
+#if defined(CONFIG_MQTT_VERSION_5_0)
+/* Called from network thread only. Topic with alias is sent empty, a new
+ * alias goes out once together with the full topic. Returns true when a new
+ * alias was registered by this publish. */
+static bool topic_alias_apply(mqtt_worker_t *worker,
+                              struct mqtt_publish_param *pub) {
+    struct mqtt_utf8 *topic = &pub->message.topic.topic;
+
+    for (int32_t i = 0; i < worker->alias_cnt; i++) {
+        if (topic->size == worker->alias_len[i] &&
+            0 == memcmp(topic->utf8, worker->alias_topic[i], topic->size)) {
+            pub->prop.topic_alias = i + 1;
+            topic->size = 0;
+            return (false);
+        }
+    }
+
+    if (worker->alias_cnt >= worker->alias_max) {
+        return (false); /* no alias left, full topic every time */
+    }
+
+    int32_t idx = worker->alias_cnt++;
+    memcpy(worker->alias_topic[idx], topic->utf8, topic->size);
+    worker->alias_len[idx] = topic->size;
+    pub->prop.topic_alias = idx + 1;
+    return (true);
+}
+#endif
+
+/* Move reserved slot to inflight unless broker receive maximum is reached */
+static bool publish_slot_inflight_try(mqtt_worker_t *worker,
+                                      publish_slot_t *slot) {
+    int32_t inflight = 0;
+    bool res = false;
+
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+        if (SLOT_INFLIGHT == worker->slots[i].state) {
+            inflight++;
+        }
+    }
+
+    if (inflight < worker->inflight_max) {
+        slot->state = SLOT_INFLIGHT;
+        slot->deadline =
+            k_uptime_get() + (MQTT_WORKER_PUBLISH_ACK_TIMEOUT * MSEC_PER_SEC);
+        res = true;
+    }
+    k_mutex_unlock(&worker->slots_lock);
+
+    return (res);
+}
+
+/* Must be called with slots_lock held. Blocking publisher is woken up here,
+ * returns true if slot belongs to async publisher which must be notified by
+ * publish_slot_notify() after the lock is released. */
+static bool publish_slot_resolve(publish_slot_t *slot, int32_t result) {
+    slot->state = SLOT_DONE;
+    slot->result = result;
+    if (slot->blocking) {
+        k_sem_give(&slot->done);
+        return (false);
+    }
+    return (true);
+}
+
+static void publish_slot_notify(mqtt_worker_t *worker, publish_slot_t *slot) {
+    if (slot->stored) {
+        if (0 < slot->result) {
+            /* MQTT 5 reason code, broker would reject it again */
+            LOG_WRN("Stored record %u rejected, reason 0x%02x, deleted",
+                    slot->store_seq, slot->result);
+            mqtt_store_ack(&worker->store, slot->store_seq);
+        } else if (0 == slot->result) {
+            mqtt_store_ack(&worker->store, slot->store_seq);
+        } else {
+            /* sent again once other stored records in flight are done */
+            mqtt_store_fail(&worker->store, slot->store_seq);
+        }
+    } else if (NULL != slot->cb) {
+        slot->cb(slot->message_id, slot->result, slot->user_data);
+    }
+    publish_slot_put(worker, slot);
+}
+
+static bool publish_slot_complete(mqtt_worker_t *worker, uint16_t message_id,
+                                  int32_t result) {
+    publish_slot_t *notify = NULL;
+    bool found = false;
+
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+        publish_slot_t *slot = &worker->slots[i];
+        if (SLOT_INFLIGHT == slot->state && message_id == slot->message_id) {
+            if (0 == result) {
+                mqtt_stats_hist_add(&worker->stats.puback,
+                                    k_uptime_ticks() - slot->sent_ticks);
+            }
+            if (publish_slot_resolve(slot, result)) {
+                notify = slot;
+            }
+            found = true;
+            break;
+        }
+    }
+    k_mutex_unlock(&worker->slots_lock);
+
+    if (NULL != notify) {
+        publish_slot_notify(worker, notify);
+    }
+
+    return (found);
+}
+
+static void publish_slots_abort(mqtt_worker_t *worker, int32_t result) {
+    publish_slot_t *notify[MQTT_WORKER_INFLIGHT_MAX];
+    int32_t notify_cnt = 0;
+
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+        publish_slot_t *slot = &worker->slots[i];
+        if (SLOT_QUEUED == slot->state || SLOT_INFLIGHT == slot->state) {
+            if (publish_slot_resolve(slot, result)) {
+                notify[notify_cnt++] = slot;
+            }
+        }
+    }
+    k_mutex_unlock(&worker->slots_lock);
+
+    for (int32_t i = 0; i < notify_cnt; i++) {
+        publish_slot_notify(worker, notify[i]);
+    }
+}
+
+/* Returns number of sent slots whose ack did not come in time */
+static int32_t publish_slots_expire(mqtt_worker_t *worker) {
+    publish_slot_t *notify[MQTT_WORKER_INFLIGHT_MAX];
+    int32_t notify_cnt = 0;
+    int32_t expired = 0;
+    int64_t uptime_ms = k_uptime_get();
+
+    /* queued ones too, broker receive maximum may hold them for long */
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+        publish_slot_t *slot = &worker->slots[i];
+        if ((SLOT_QUEUED == slot->state || SLOT_INFLIGHT == slot->state) &&
+            slot->deadline <= uptime_ms) {
+            LOG_ERR("publish ack timeout, id %u", slot->message_id);
+            mqtt_stats_inc(&worker->stats, MQTT_STATS_TIMEOUT);
+            expired += (SLOT_INFLIGHT == slot->state) ? 1 : 0;
+            if (publish_slot_resolve(slot, -ETIMEDOUT)) {
+                notify[notify_cnt++] = slot;
+            }
+        }
+    }
+    k_mutex_unlock(&worker->slots_lock);
+
+    for (int32_t i = 0; i < notify_cnt; i++) {
+        publish_slot_notify(worker, notify[i]);
+    }
+
+    return (expired);
+}
+
+static int64_t publish_slots_next_deadline(mqtt_worker_t *worker) {
+    int64_t deadline = INT64_MAX;
+
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+        publish_slot_t *slot = &worker->slots[i];
+        if (SLOT_QUEUED == slot->state || SLOT_INFLIGHT == slot->state) {
+            deadline = MIN(deadline, slot->deadline);
+        }
+    }
+    k_mutex_unlock(&worker->slots_lock);
+
+    return (deadline);
+}
+
+static void publish_queue_process(mqtt_worker_t *worker) {
+    uint16_t message_id = 0U;
+
+    /* only this thread takes from the queue, peeked head stays the head */
+    while (0 == k_msgq_peek(&worker->publish_queue, &message_id)) {
+        publish_slot_t *slot = NULL;
+
+        k_mutex_lock(&worker->slots_lock, K_FOREVER);
+        for (int32_t i = 0; i < MQTT_WORKER_INFLIGHT_MAX; i++) {
+            if (SLOT_QUEUED == worker->slots[i].state &&
+                message_id == worker->slots[i].message_id) {
+                slot = &worker->slots[i];
+                break;
+            }
+        }
+        k_mutex_unlock(&worker->slots_lock);
+
+        if (NULL != slot && !publish_slot_inflight_try(worker, slot)) {
+            break; /* next PUBACK makes room */
+        }
+        k_msgq_get(&worker->publish_queue, &message_id, K_NO_WAIT);
+
+        if (NULL == slot) { /* aborted while waiting in queue */
+            continue;
+        }
+
+        int32_t res = publish_slot_send(worker, slot);
+        if (0 != res) {
+            LOG_ERR("could not publish, err %d", res);
+            publish_slot_complete(worker, message_id, res);
+        }
+    }
+}
+
+static int32_t publish_enqueue(mqtt_worker_t *worker, const char *topic,
+                               uint16_t topic_len, const uint8_t *payload,
+                               uint16_t payload_len, publish_cb_t cb,
+                               void *user_data, const uint32_t *store_seq) {
+    int32_t res = 0;
+    publish_slot_t *slot = publish_slot_get(worker, K_NO_WAIT);
+
+    if (NULL == slot) {
+        res = -ENOMEM;
+        goto failed_done;
+    }
+
+    res = publish_slot_topic_set(slot, topic, topic_len);
+    if (0 != res) {
+        publish_slot_put(worker, slot);
+        goto failed_done;
+    }
+
+    memcpy(slot->buffer, payload, payload_len);
+    slot->payload_len = payload_len;
+    slot->cb = cb;
+    slot->user_data = user_data;
+    if (NULL != store_seq) {
+        slot->stored = true;
+        slot->store_seq = *store_seq;
+    }
+    res = slot->message_id;
+
+    publish_slot_queue(worker, slot);
+
+failed_done:
+    return (res);
+}
+
+static int32_t publish_store(mqtt_worker_t *worker, const char *topic,
+                             uint16_t topic_len, const uint8_t *payload,
+                             uint16_t payload_len) {
+    int32_t res = mqtt_store_append(&worker->store, topic, topic_len, payload,
+                                    payload_len);
+
+    if (0 > res) {
+        LOG_WRN("Cannot publish, client not connected");
+        return (-ENOTCONN);
+    }
+
+    LOG_DBG("Client not connected, message stored, seq %d", res);
+    mqtt_stats_inc(&worker->stats, MQTT_STATS_STORED);
+    return (0);
+}
+
+/* Never blocks, NVS write and its garbage collection happen in the network
+ * thread, publish_store_pending() */
+static int32_t publish_store_defer(mqtt_worker_t *worker, const char *topic,
+                                   uint16_t topic_len, const uint8_t *payload,
+                                   uint16_t payload_len) {
+    store_pending_t *item =
+        k_heap_alloc(&StorePendingHeap,
+                     sizeof(*item) + topic_len + payload_len, K_NO_WAIT);
+
+    if (NULL == item) {
+        LOG_WRN("Cannot publish, offline store busy");
+        return (-ENOMEM);
+    }
+
+    item->topic_len = topic_len;
+    item->payload_len = payload_len;
+    memcpy(item->data, topic, topic_len);
+    memcpy(item->data + topic_len, payload, payload_len);
+    k_fifo_put(&worker->store_pending, item);
+    worker_wakeup(worker);
+    return (0);
+}
+
+static void publish_store_pending(mqtt_worker_t *worker) {
+    store_pending_t *item = NULL;
+
+    while (NULL != (item = k_fifo_get(&worker->store_pending, K_NO_WAIT))) {
+        publish_store(worker, (char *)item->data, item->topic_len,
+                      item->data + item->topic_len, item->payload_len);
+        k_heap_free(&StorePendingHeap, item);
+    }
+}
+
+static void publish_store_drain(mqtt_worker_t *worker) {
+    mqtt_store_record_t *rec = &worker->drain_rec;
+
+    int64_t uptime_ms = k_uptime_get();
+    if (uptime_ms < worker->next_store_drain) {
+        return;
+    }
+    worker->next_store_drain = uptime_ms + MQTT_WORKER_STORE_DRAIN_INTERVAL;
 
-LOG_MODULE_REGISTER(MQTT, LOG_LEVEL_DBG);
+    for (int32_t i = 0; i < MQTT_WORKER_STORE_DRAIN_BATCH; i++) {
+        /* keep some slots for live traffic during reconnect burst */
+        if (k_sem_count_get(&worker->slots_free) <=
+            MQTT_WORKER_STORE_LIVE_SLOTS) {
+            break;
+        }
 
-typedef struct subs_data {
-    uint8_t topic[MQTT_WORKER_MAX_TOPIC_LEN];
-    uint16_t topic_len;
-    uint8_t payload[MQTT_WORKER_MAX_PAYLOAD_LEN];
-    uint16_t payload_len;
-} subs_data_t;
+        if (0 != mqtt_store_next(&worker->store, rec)) {
+            break;
+        }
 
-typedef enum worker_state {
-    DNS_RESOLVE,
-    CONNECT_TO_BROKER,
-    SUBSCRIBE,
-    CONNECTED,
-    DISCONNECTED
-} worker_state_t;
+        int32_t res = publish_enqueue(
+            worker, (char *)rec->data, rec->topic_len,
+            rec->data + rec->topic_len, rec->payload_len, NULL, NULL,
+            &rec->seq);
+        if (0 > res) {
+            mqtt_store_fail(&worker->store, rec->seq);
+            break;
+        }
+    }
+}
 
-static void mqtt_evt_handler(struct mqtt_client *const client,
-                             const struct mqtt_evt *evt);
-static int32_t wait_for_input(int32_t timeout);
-static int32_t dns_resolve(void);
-static int32_t connect_to_broker(void);
-static int32_t input_handle(void);
-static int32_t mqtt_worker_subscribe(void);
+/* Called from network thread only. Unacked messages of the session take
+ * slots like new ones, so inflight window applies after reconnect too */
+static void session_resend_drain(mqtt_worker_t *worker) {
+    while (worker->resending) {
+        publish_slot_t *slot = publish_slot_get(worker, K_NO_WAIT);
+        if (NULL == slot) {
+            break; /* next PUBACK frees one */
+        }
 
-static void mqtt_proc(void *, void *, void *);
-static void subscribe_proc(void *, void *, void *);
+        uint16_t message_id = mqtt_session_resend_next(
+            &worker->session, slot->topic, &slot->topic_len,
+            (uint8_t *)slot->buffer, &slot->payload_len, &slot->retain);
+        if (0U == message_id) {
+            worker->resending = false;
+            publish_slot_put(worker, slot);
+            break;
+        }
 
-/* The mqtt client struct */
-static struct mqtt_client ClientCtx;
+        /* id taken by publish_slot_get() is left unused */
+        slot->message_id = message_id;
+        slot->resent = true;
+        publish_slot_queue(worker, slot);
+    }
+}
 
-/* MQTT Broker details. */
-static struct sockaddr_storage Broker;
+static void dispatch_start(void) {
+    for (int32_t i = 0; i < MQTT_WORKER_DISPATCH_THREADS; i++) {
+        k_msgq_init(&DispatchQueues[i], (char *)DispatchQueueBufs[i],
+                    sizeof(mqtt_worker_msg_t *),
+                    MQTT_WORKER_DISPATCH_QUEUE_LEN);
+        k_mutex_init(&DispatchLocks[i]);
+        k_tid_t tid = k_thread_create(
+            &DispatchThreads[i], DispatchStacks[i],
+            K_THREAD_STACK_SIZEOF(DispatchStacks[i]), dispatch_proc,
+            &DispatchQueues[i], INT_TO_POINTER(i), NULL, DISPATCH_PRIORITY, 0,
+            K_NO_WAIT);
+        k_thread_name_set(tid, "mqtt_dispatch");
+    }
+}
 
-/* Buffers for MQTT client. */
-static uint8_t RxBuffer[1024];
-static uint8_t TxBuffer[1024];
+static void dispatch_proc(void *arg1, void *arg2, void *arg3) {
+    struct k_msgq *queue = (struct k_msgq *)arg1;
+    int32_t idx = POINTER_TO_INT(arg2);
+    mqtt_worker_msg_t *msg = NULL;
+    struct k_poll_event event = K_POLL_EVENT_INITIALIZER(
+        K_POLL_TYPE_MSGQ_DATA_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY, queue);
 
-static char BrokerHostnameStr[32];
-static char BrokerAddrStr[16];
-static char BrokerPortStr[32];
-static int32_t BrokerPort = 0;
-struct mqtt_subscription_list *SubsList = NULL;
-static struct mqtt_publish_param PubData = {0};
-static enum mqtt_evt_type LastEvt = 0;
+    for (;;) {
+        k_poll(&event, 1, K_FOREVER);
+        event.state = K_POLL_STATE_NOT_READY;
+
+        /* message may have been evicted since the poll returned */
+        k_mutex_lock(&DispatchLocks[idx], K_FOREVER);
+        int32_t res = k_msgq_get(queue, &msg, K_NO_WAIT);
+        k_mutex_unlock(&DispatchLocks[idx]);
+
+        if (0 == res) {
+            /* room made, network thread holding a message may go on */
+            for (int32_t i = 0; i < WorkersCnt; i++) {
+                if (NULL != atomic_ptr_get(&Workers[i].rx_held)) {
+                    worker_wakeup(&Workers[i]);
+                }
+            }
 
-static worker_state_t StateMachine = DNS_RESOLVE;
-static char PublishBuffer[MQTT_WORKER_MAX_PUBLISH_LEN];
+            mqtt_stats_hist_add(&msg->worker->stats.dispatch[idx],
+                                k_uptime_ticks() - msg->rx_ticks);
 
-static bool Connected = false;
-static bool DisconnectReqExternal = false;
-static bool Subscribed = false;
+            /* Each handler releases the message, last release may free it
+             * while the loop still runs, so nothing is read from it after */
+            int32_t cnt = msg->handler_cnt;
+            subs_cb_t *handlers = msg->handlers;
+            atomic_set(&msg->ref, cnt);
+            for (int32_t i = 0; i < cnt; i++) {
+                handlers[i](msg);
+            }
+        }
+    }
+}
 
-static subs_cb_t SubsCb = NULL;
+/* Same topic always goes to the same thread, so its order is kept */
+static struct k_msgq *dispatch_queue(const mqtt_worker_msg_t *msg) {
+    uint32_t hash = topic_router_hash(msg->topic, msg->topic_len);
+    return (&DispatchQueues[hash % MQTT_WORKER_DISPATCH_THREADS]);
+}
 
-#define MQTT_NET_STACK_SIZE (2 * 1024)
-#define MQTT_NET_PRIORITY   (5)
-K_THREAD_DEFINE(MqttNetTid, MQTT_NET_STACK_SIZE, mqtt_proc, NULL, NULL, NULL,
-                MQTT_NET_PRIORITY, 0, 0);
+/* Never blocks. Returns 0 when queued, -EAGAIN when held for backpressure,
+ * -ENOBUFS when dropped. */
+static int32_t subs_dispatch(mqtt_worker_t *worker, mqtt_worker_msg_t *msg,
+                             mqtt_worker_overflow_t overflow) {
+    struct k_msgq *queue = dispatch_queue(msg);
+    struct k_mutex *lock = &DispatchLocks[queue - DispatchQueues];
+    mqtt_worker_msg_t *oldest = NULL;
+
+    msg->overflow = overflow;
+    if (0 == k_msgq_put(queue, &msg, K_NO_WAIT)) {
+        goto queued_done;
+    }
 
-#define SUBSCRIBE_STACK_SIZE (2 * 1024)
-#define SUBSCRIBE_PRIORITY   (5)
-K_THREAD_DEFINE(SubsTid, SUBSCRIBE_STACK_SIZE, subscribe_proc, NULL, NULL, NULL,
-                SUBSCRIBE_PRIORITY, 0, 0);
+    switch (overflow) {
+        case MQTT_WORKER_DROP_OLDEST: {
+            /* Queue is shared with other topics and instances, the oldest
+             * message is evicted only when its own filter allows it */
+            k_mutex_lock(lock, K_FOREVER);
+            if (0 == k_msgq_peek(queue, &oldest) &&
+                MQTT_WORKER_DROP_OLDEST == oldest->overflow) {
+                k_msgq_get(queue, &oldest, K_NO_WAIT);
+            } else {
+                oldest = NULL;
+            }
+            k_mutex_unlock(lock);
 
-K_SEM_DEFINE(PublishAck, 0, 1);
-K_MSGQ_DEFINE(SubsQueue, sizeof(subs_data_t *), 4, 4);
-K_MEM_SLAB_DEFINE_STATIC(SubsQueueSlab, sizeof(subs_data_t), 4, 4);
+            if (NULL != oldest) {
+                LOG_WRN("Dispatch queue full, oldest dropped");
+                mqtt_stats_inc(&oldest->worker->stats, MQTT_STATS_DROPPED);
+                mqtt_worker_msg_release(oldest);
+            }
+            /* other instance may have taken the room, then drop this one */
+            if (0 == k_msgq_put(queue, &msg, K_NO_WAIT)) {
+                goto queued_done;
+            }
+            break;
+        }
+        case MQTT_WORKER_BACKPRESSURE: {
+            if (atomic_ptr_cas(&worker->rx_held, NULL, msg)) {
+                return (-EAGAIN);
+            }
+            break; /* read during connect or subscribe, can not hold two */
+        }
+        default: {
+            break;
+        }
+    }
 
-void mqtt_worker_disconnect(void) {
-    DisconnectReqExternal = true;
-}
+    LOG_WRN("Dispatch queue full, message dropped");
+    mqtt_stats_inc(&worker->stats, MQTT_STATS_DROPPED);
+    mqtt_worker_msg_release(msg);
+    return (-ENOBUFS);
 
-void mqtt_worker_connection_attempt(void) {
-    StateMachine = DNS_RESOLVE;
+queued_done:
+    mqtt_stats_inc(&worker->stats, MQTT_STATS_RECEIVED);
+    mqtt_stats_max_update(&DispatchQueueMax, k_msgq_num_used_get(queue));
+    return (0);
 }
 
-int32_t mqtt_worker_publish_qos1(const char *topic, const char *fmt, ...) {
-    int32_t res = -1;
+/* Returns true while held message still waits for room */
+static bool subs_held_retry(mqtt_worker_t *worker) {
+    mqtt_worker_msg_t *held = atomic_ptr_get(&worker->rx_held);
+    struct k_msgq *queue = NULL;
 
-    va_list args;
-    va_start(args, fmt);
+    if (NULL == held) {
+        return (false);
+    }
 
-    if (!Connected || DisconnectReqExternal) {
-        LOG_WRN("Cannot publish, client not connected");
-        goto failed_done;
+    queue = dispatch_queue(held);
+    if (0 != k_msgq_put(queue, &held, K_NO_WAIT)) {
+        return (true);
     }
 
-    uint32_t len =
-        vsnprintf(PublishBuffer, MQTT_WORKER_MAX_PUBLISH_LEN, fmt, args);
+    atomic_ptr_clear(&worker->rx_held);
+    if (0U != worker->rx_held_ack) {
+        subs_ack(worker, worker->rx_held_ack);
+        worker->rx_held_ack = 0U;
+    }
+    mqtt_stats_inc(&worker->stats, MQTT_STATS_RECEIVED);
+    mqtt_stats_max_update(&DispatchQueueMax, k_msgq_num_used_get(queue));
 
-    PubData.message.payload.len = len;
-    PubData.message.topic.topic.utf8 = (uint8_t *)topic;
-    PubData.message.topic.topic.size = strlen((const char *)topic);
-    PubData.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
-    PubData.message_id += 1U;
+    /* PINGRESP may wait in the socket behind held messages */
+    if (INT64_MAX != worker->ping_deadline) {
+        worker->ping_deadline =
+            k_uptime_get() + MQTT_WORKER_PINGRESP_TIMEOUT * MSEC_PER_SEC;
+    }
+    return (false);
+}
 
-    struct mqtt_client *client = &ClientCtx;
+/* Read payload of received publish and hand it to its dispatch thread.
+ * Returns -EAGAIN when held for backpressure, otherwise the message was
+ * queued or dropped. */
+static int32_t subs_receive(mqtt_worker_t *worker,
+                            const struct mqtt_publish_param *pub) {
+    struct mqtt_client *client = &worker->client;
+    const struct mqtt_utf8 *topic = &pub->message.topic.topic;
+    int32_t len = pub->message.payload.len;
+    mqtt_worker_overflow_t overflow = MQTT_WORKER_DROP_NEWEST;
+    subs_cb_t handlers[TOPIC_ROUTER_MAX_FILTERS];
+
+    k_mutex_lock(&RouterLock, K_FOREVER);
+    int32_t cnt = topic_router_match(&worker->router, (const char *)topic->utf8,
+                                     topic->size, handlers,
+                                     ARRAY_SIZE(handlers), &overflow);
+    k_mutex_unlock(&RouterLock);
+
+    if (0 == cnt) {
+        LOG_WRN("No handler for topic %.*s", topic->size, topic->utf8);
+        subs_payload_discard(client, len);
+        return (-ENOENT);
+    }
 
-    k_sem_take(&PublishAck, K_NO_WAIT);
-    res = mqtt_publish(client, &PubData);
-    if (0 != res) {
-        LOG_ERR("could not publish, err %d", res);
-        goto failed_done;
+    mqtt_worker_msg_t *msg = subs_msg_alloc(worker, pub, handlers, cnt);
+    if (NULL == msg) {
+        LOG_ERR("No memory for subs msg, %d bytes", len);
+        mqtt_stats_inc(&worker->stats, MQTT_STATS_DROPPED);
+        subs_payload_discard(client, len);
+        return (-ENOMEM);
+    }
+    LOG_DBG("   topic: %s", msg->topic);
+
+    /* whole payload straight into the delivered buffer */
+    if (0 > mqtt_readall_publish_payload(client, msg->payload, len)) {
+        LOG_ERR("Failure to read payload");
+        mqtt_stats_inc(&worker->stats, MQTT_STATS_DROPPED);
+        mqtt_worker_msg_release(msg);
+        return (-EIO);
     }
 
-    res = k_sem_take(&PublishAck, K_SECONDS(MQTT_WORKER_PUBLISH_ACK_TIMEOUT));
-    if (0 != res) {
-        LOG_ERR("publish ack timeout");
+    return (subs_dispatch(worker, msg, overflow));
+}
+
+/* Not acked held message is sent again by the broker after reconnect */
+static void subs_held_drop(mqtt_worker_t *worker) {
+    mqtt_worker_msg_t *held = atomic_ptr_clear(&worker->rx_held);
+
+    worker->rx_held_ack = 0U;
+    if (NULL != held) {
+        mqtt_stats_inc(&worker->stats, MQTT_STATS_DROPPED);
+        mqtt_worker_msg_release(held);
     }
+}
 
-failed_done:
-    va_end(args);
-    return (res);
+static void subs_ack(mqtt_worker_t *worker, uint16_t message_id) {
+    struct mqtt_puback_param ack = {
+        .message_id = message_id,
+    };
+    int32_t res = mqtt_publish_qos1_ack(&worker->client, &ack);
+
+    if (0 != res) {
+        LOG_ERR("PUBACK %u not sent, err %d", message_id, res);
+    }
 }
 
-void mqtt_worker_init(const char *hostname, int32_t port,
-                      struct mqtt_subscription_list *subs, subs_cb_t subs_cb) {
-    struct mqtt_client *client = &ClientCtx;
+static mqtt_worker_msg_t *subs_msg_alloc(mqtt_worker_t *worker,
+                                         const struct mqtt_publish_param *pub,
+                                         const subs_cb_t *handlers,
+                                         int32_t handler_cnt) {
+    uint16_t topic_len = pub->message.topic.topic.size;
+    uint32_t payload_len = pub->message.payload.len;
+    size_t handlers_size = handler_cnt * sizeof(subs_cb_t);
+
+    /* One block: descriptor, matched handlers, topic and payload, both
+     * strings terminated. Heap is freed by handlers, so never wait here. */
+    size_t total = sizeof(mqtt_worker_msg_t) + handlers_size + topic_len + 1 +
+                   payload_len + 1;
+    mqtt_worker_msg_t *msg = k_heap_alloc(&SubsHeap, total, K_NO_WAIT);
+    if (NULL == msg) {
+        goto alloc_done;
+    }
 
-    SubsCb = subs_cb;
-    SubsList = subs;
-    strncpy(BrokerHostnameStr, hostname, sizeof(BrokerHostnameStr));
-    BrokerPort = port;
-    snprintf(BrokerPortStr, sizeof(BrokerPortStr), "%d", port);
+    msg->handlers = (subs_cb_t *)(msg + 1);
+    msg->handler_cnt = handler_cnt;
+    memcpy(msg->handlers, handlers, handlers_size);
+
+    char *topic = (char *)msg->handlers + handlers_size;
+    memcpy(topic, pub->message.topic.topic.utf8, topic_len);
+    topic[topic_len] = '\0';
+
+    msg->worker = worker;
+    msg->rx_ticks = k_uptime_ticks();
+    msg->topic = topic;
+    msg->topic_len = topic_len;
+    msg->payload = (uint8_t *)topic + topic_len + 1;
+    msg->payload_len = payload_len;
+    msg->payload[payload_len] = '\0';
+    atomic_set(&msg->ref, 1);
+
+alloc_done:
+    return (msg);
+}
 
-    mqtt_client_init(client);
+static void subs_payload_discard(struct mqtt_client *client, int32_t len) {
+    uint8_t tmp[32];
 
-    /* MQTT client configuration */
-    client->broker = &Broker;
-    client->evt_cb = mqtt_evt_handler;
-    client->protocol_version = MQTT_VERSION_3_1_1;
-    client->client_id.utf8 = (uint8_t *)MQTT_WORKER_CLIENT_ID;
-    client->client_id.size = strlen(MQTT_WORKER_CLIENT_ID);
-    client->password = NULL;
-    client->user_name = NULL;
+    while (len) { /* cleanup mqtt socket buffer */
+        int32_t bytes_read = mqtt_read_publish_payload_blocking(
+            client, tmp, len >= sizeof(tmp) ? sizeof(tmp) : len);
+        if (0 > bytes_read) {
+            break;
+        }
+        len -= bytes_read;
+    }
+}
 
-    /* MQTT buffers configuration */
-    client->rx_buf = RxBuffer;
-    client->rx_buf_size = sizeof(RxBuffer);
-    client->tx_buf = TxBuffer;
-    client->tx_buf_size = sizeof(TxBuffer);
+/* Stats of objects shared by all instances, returns number of fields */
+static size_t shared_stats_fields(payload_field_t *fields) {
+    size_t cnt = 0;
+
+    fields[cnt++] =
+        (payload_field_t)PAYLOAD_INT("subq", atomic_get(&DispatchQueueMax));
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS)
+    struct sys_memory_stats mem;
+    if (0 == sys_heap_runtime_stats_get(&SubsHeap.heap, &mem)) {
+        fields[cnt++] =
+            (payload_field_t)PAYLOAD_INT("subh", mem.max_allocated_bytes);
+    }
+#endif
+#if defined(CONFIG_SCHED_THREAD_USAGE_ALL)
+    /* share of time since boot the CPU was not idle, per mille */
+    k_thread_runtime_stats_t usage;
+    if (0 == k_thread_runtime_stats_all_get(&usage) &&
+        0 < usage.execution_cycles) {
+        uint64_t busy = usage.execution_cycles - usage.idle_cycles;
+        fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+            "cpu", busy * 1000 / usage.execution_cycles);
+    }
+#endif
+    return (cnt);
+}
 
-    PubData.message.payload.data = (uint8_t *)PublishBuffer;
-    PubData.message_id = 1U;
-    PubData.dup_flag = 0U;
-    PubData.retain_flag = 1U;
+/* Reconnect cost of one instance, returns number of fields. Backoff is
+ * updated by the network thread, a value read meanwhile may be one behind. */
+static size_t worker_stats_fields(mqtt_worker_t *worker,
+                                  payload_field_t *fields) {
+    size_t cnt = 0;
+
+    fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+        "retry", backoff_total_attempts(&worker->backoff));
+    fields[cnt++] = (payload_field_t)PAYLOAD_INT(
+        "rtime", backoff_recovery_ms(&worker->backoff) / MSEC_PER_SEC);
+    return (cnt);
 }
 
-static void subscribe_proc(void *arg1, void *arg2, void *arg3) {
-    subs_data_t *subs_data = NULL;
-    for (;;) {
-        if (0 == k_msgq_get(&SubsQueue, &subs_data, K_SECONDS(1))) {
-            /* handle incomming message here*/
-            if (NULL != SubsCb) {
-                SubsCb((char *)subs_data->topic, subs_data->topic_len,
-                       (char *)subs_data->payload, subs_data->payload_len);
-            }
-            k_mem_slab_free(&SubsQueueSlab, (void **)&subs_data);
+#if defined(CONFIG_SHELL)
+static int cmd_mqtt_stats(const struct shell *sh, size_t argc, char **argv) {
+    payload_field_t shared[MQTT_STATS_EXTRA_MAX];
+
+    for (int32_t i = 0; i < WorkersCnt; i++) {
+        shell_print(sh, "%s:%d", Workers[i].hostname, Workers[i].port);
+        mqtt_stats_print(&Workers[i].stats, sh);
+
+        size_t cnt = worker_stats_fields(&Workers[i], shared);
+        for (size_t j = 0; j < cnt; j++) {
+            shell_print(sh, "  %-5s %d", shared[j].key, shared[j].value.i);
         }
     }
+
+    size_t cnt = shared_stats_fields(shared);
+    shell_print(sh, "shared");
+    for (size_t i = 0; i < cnt; i++) {
+        shell_print(sh, "  %-5s %d", shared[i].key, shared[i].value.i);
+    }
+    return (0);
 }
 
+SHELL_STATIC_SUBCMD_SET_CREATE(MqttCmds,
+                               SHELL_CMD(stats, NULL,
+                                         "Counters, state times and latency "
+                                         "histograms of all instances",
+                                         cmd_mqtt_stats),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(mqtt, &MqttCmds, "MQTT worker", NULL);
+#endif
+
 static void mqtt_proc(void *arg1, void *arg2, void *arg3) {
-    StateMachine = DISCONNECTED;
-    Connected = false;
+    mqtt_worker_t *worker = (mqtt_worker_t *)arg1;
+
+    worker->state = DISCONNECTED;
+    worker->connected = false;
     for (;;) {
-        switch (StateMachine) {
+        if (atomic_test_and_clear_bit(&worker->requests, REQUEST_DISCONNECT)) {
+            if (SUBSCRIBE == worker->state || CONNECTED == worker->state) {
+                mqtt_disconnect(&worker->client);
+                worker->connected = false;
+            }
+            worker->state = DISCONNECTED;
+        }
+
+        if (atomic_test_and_clear_bit(&worker->requests, REQUEST_CONNECT)) {
+            /* fresh address, no reason to wait out the backoff */
+            worker->reconnect_at = 0;
+            if (DISCONNECTED == worker->state) {
+                worker->state = DNS_RESOLVE;
+            }
+        }
+
+        /* Socket is closed in these states, buffers go back to the pool.
+         * Publish queued right when the link dropped fails here, waiting for
+         * the next connection would block its publisher for long. */
+        if (DNS_RESOLVE == worker->state || DISCONNECTED == worker->state) {
+            mqtt_session_flush(&worker->session);
+            worker_buffers_put(worker);
+            k_msgq_purge(&worker->publish_queue);
+            publish_slots_abort(worker, -ENOTCONN);
+            subs_held_drop(worker);
+        }
+
+        publish_store_pending(worker);
+        mqtt_stats_state_set(&worker->stats, worker->state);
+
+        switch (worker->state) {
             case DNS_RESOLVE: {
+                int64_t delay_ms = worker->reconnect_at - k_uptime_get();
+                if (0 < delay_ms) {
+                    wait_for_request(worker, K_MSEC(delay_ms));
+                    break;
+                }
+
                 LOG_INF("DNS_RESOLVE");
-                int32_t res = dns_resolve();
+                int32_t res = dns_resolve(worker);
                 if (0 == res) {
-                    StateMachine = CONNECT_TO_BROKER;
+                    worker->state = CONNECT_TO_BROKER;
                 } else {
-                    k_sleep(K_SECONDS(2));
+                    wait_for_request(worker,
+                                     K_MSEC(backoff_next(&worker->backoff)));
                 }
                 break;
             }
             case CONNECT_TO_BROKER: {
                 LOG_INF("CONNECT_TO_BROKER");
-                static int32_t err_trials = 0;
-                int32_t res = connect_to_broker();
+                int32_t res = connect_to_broker(worker);
                 if (0 == res) {
                     LOG_INF("MQTT client connected!");
-                    StateMachine = SUBSCRIBE;
-                    err_trials = 0;
+                    dns_cache_confirm(&worker->dns);
+                    worker->state = SUBSCRIBE;
+                    worker->subscribe_trials = 0;
                 } else {
-                    err_trials++;
-                    if (4 == err_trials) {
-                        StateMachine = DNS_RESOLVE;
-                        err_trials = 0;
-                    }
-                    k_sleep(K_SECONDS(2));
+                    /* next cached address, fresh lookup when all tried */
+                    worker->state = DNS_RESOLVE;
+                    wait_for_request(worker,
+                                     K_MSEC(backoff_next(&worker->backoff)));
                 }
                 break;
             }
             case SUBSCRIBE: {
                 LOG_INF("SUBSCRIBE");
-                static int32_t err_trials = 0;
-                int32_t res = mqtt_worker_subscribe();
+                int32_t res = mqtt_worker_subscribe(worker);
                 if (0 == res) {
                     LOG_INF("Subscribe done");
-                    StateMachine = CONNECTED;
-                    err_trials = 0;
+                    backoff_reset(&worker->backoff);
+                    if (MQTT_WORKER_PERSISTENT_SESSION) {
+                        int32_t cnt =
+                            mqtt_session_resend_start(&worker->session);
+                        LOG_INF("Resending %d unacked messages", cnt);
+                        worker->resending = (0 < cnt);
+                    }
+                    worker->state = CONNECTED;
                 } else {
-                    err_trials++;
-                    if (4 == err_trials) {
-                        StateMachine = DNS_RESOLVE;
-                        err_trials = 0;
+                    worker->subscribe_trials++;
+                    if (4 == worker->subscribe_trials) {
+                        mqtt_abort(&worker->client);
+                        worker->state = DNS_RESOLVE;
                     }
                 }
+                break;
             }
             case CONNECTED: {
-                LOG_INF("CONNECTED");
-                int32_t res = input_handle();
+                int32_t res = input_handle(worker);
                 if (0 != res) {
-                    StateMachine = DISCONNECTED;
+                    /* broker restart or dead link while Wi-Fi stays up,
+                     * no network event comes, so reconnect on its own */
+                    uint32_t delay_ms = backoff_next(&worker->backoff);
+                    LOG_WRN("Broker link lost, reconnect in %u ms", delay_ms);
+                    mqtt_stats_inc(&worker->stats, MQTT_STATS_LINK_LOST);
+                    worker->reconnect_at = k_uptime_get() + delay_ms;
+                    worker->state = DNS_RESOLVE;
                 }
                 break;
             }
             case DISCONNECTED: {
-                k_sleep(K_MSEC(10));
+                /* parked by mqtt_worker_disconnect(), nothing to do until
+                 * connection attempt is requested */
+                worker->reconnect_at = 0;
+                wait_for_request(worker, K_FOREVER);
+                break;
             }
             default: {
                 break;
@@ -244,28 +1561,39 @@ static void mqtt_proc(void *arg1, void *arg2, void *arg3) {
     }
 }
 
-static int32_t mqtt_worker_subscribe(void) {
-    struct mqtt_client *client = &ClientCtx;
+static int32_t mqtt_worker_subscribe(mqtt_worker_t *worker) {
+    struct mqtt_client *client = &worker->client;
     int32_t res = 0;
 
-    if (NULL == SubsList) {
+    /* same id space as publishes, so SUBACK is never taken for a PUBACK
+     * of an unacked message, may write flash so taken before the lock */
+    worker->subscribe_id = mqtt_session_message_id_next(&worker->session);
+
+    k_mutex_lock(&RouterLock, K_FOREVER);
+    struct mqtt_subscription_list *subs_list =
+        topic_router_subs_list(&worker->router);
+    if (NULL == subs_list) {
+        k_mutex_unlock(&RouterLock);
         LOG_WRN("Subscription list empty");
         goto failed_done;
     }
 
-    Subscribed = false;
-    res = mqtt_subscribe(client, SubsList);
+    worker->subscribed = false;
+    subs_list->message_id = worker->subscribe_id;
+    res = mqtt_subscribe(client, subs_list);
+    k_mutex_unlock(&RouterLock);
     if (0 != res) {
         LOG_ERR("Failed to subscribe topics, err %d", res);
         goto failed_done;
     }
 
     while (true) {
-        LastEvt = 0xFF;
-        res = wait_for_input(4000);
+        worker->last_evt = 0xFF;
+        res = wait_for_input(worker, 4000, false);
         if (0 < res) {
             mqtt_input(client);
-            if (LastEvt != MQTT_EVT_SUBACK && LastEvt != 0xFF) {
+            if (worker->last_evt != MQTT_EVT_SUBACK &&
+                worker->last_evt != 0xFF) {
                 LOG_WRN("Unexpected event got, try again");
                 continue;
             }
@@ -273,7 +1601,7 @@ static int32_t mqtt_worker_subscribe(void) {
         break;
     }
 
-    if (!Subscribed) {
+    if (!worker->subscribed) {
         LOG_ERR("Subscribe timeout");
     } else {
         res = 0;
@@ -283,54 +1611,230 @@ failed_done:
     return (res);
 }
 
-static int32_t wait_for_input(int32_t timeout) {
+/* Returns positive value when socket is readable, 0 on timeout or wakeup */
+static int32_t wait_for_input(mqtt_worker_t *worker, int32_t timeout,
+                              bool wakeable) {
 #if defined(CONFIG_MQTT_LIB_TLS)
-    struct zsock_pollfd fds[1] = {
+    int sock = worker->client.transport.tls.sock;
+#else
+    int sock = worker->client.transport.tcp.sock;
+#endif
+    struct zsock_pollfd fds[2] = {
         [0] =
             {
-                .fd = ClientCtx.transport.tls.sock,
+                .fd = sock,
                 .events = ZSOCK_POLLIN,
                 .revents = 0,
             },
-    };
-#else
-    struct zsock_pollfd fds[1] = {
-        [0] =
+        [1] =
             {
-                .fd = ClientCtx.transport.tcp.sock,
+                .fd = worker->wakeup_fd,
                 .events = ZSOCK_POLLIN,
                 .revents = 0,
             },
     };
+    int32_t nfds = 1;
+
+    if (wakeable) {
+#if defined(CONFIG_EVENTFD)
+        nfds = (0 <= worker->wakeup_fd) ? 2 : 1;
+#else
+        timeout = (0 > timeout) ? WAIT_SLICE_NO_EVENTFD
+                                : MIN(timeout, WAIT_SLICE_NO_EVENTFD);
 #endif
+    }
 
-    int32_t res = zsock_poll(fds, 1, timeout);
+    int32_t res = zsock_poll(fds, nfds, timeout);
+    mqtt_stats_inc(&worker->stats, MQTT_STATS_WAKEUPS);
     if (0 > res) {
         LOG_ERR("zsock_poll event err %d", res);
+        return (res);
     }
 
-    return (res);
+#if defined(CONFIG_EVENTFD)
+    if (2 == nfds && (fds[1].revents & ZSOCK_POLLIN)) {
+        eventfd_t value;
+        eventfd_read(worker->wakeup_fd, &value);
+    }
+#endif
+
+    return (0 != fds[0].revents ? 1 : 0);
+}
+
+/* Sleep until timeout expires or other thread requests something */
+static void wait_for_request(mqtt_worker_t *worker, k_timeout_t timeout) {
+    struct k_poll_event events[1] = {
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY,
+                                 &worker->wakeup_signal),
+    };
+
+    k_poll(events, ARRAY_SIZE(events), timeout);
+    k_poll_signal_reset(&worker->wakeup_signal);
+    mqtt_stats_inc(&worker->stats, MQTT_STATS_WAKEUPS);
+}
+
+static void worker_wakeup(mqtt_worker_t *worker) {
+    k_poll_signal_raise(&worker->wakeup_signal, 0);
+#if defined(CONFIG_EVENTFD)
+    if (0 <= worker->wakeup_fd) {
+        eventfd_write(worker->wakeup_fd, 1);
+    }
+#endif
+}
+
+static int32_t worker_buffers_get(mqtt_worker_t *worker) {
+    struct mqtt_client *client = &worker->client;
+
+    if (NULL == client->rx_buf) {
+        client->rx_buf =
+            k_heap_alloc(&BufferPool, MQTT_WORKER_BUFFER_SIZE, K_NO_WAIT);
+        client->rx_buf_size = MQTT_WORKER_BUFFER_SIZE;
+    }
+    if (NULL == client->tx_buf) {
+        client->tx_buf =
+            k_heap_alloc(&BufferPool, MQTT_WORKER_BUFFER_SIZE, K_NO_WAIT);
+        client->tx_buf_size = MQTT_WORKER_BUFFER_SIZE;
+    }
+
+    if (NULL == client->rx_buf || NULL == client->tx_buf) {
+        LOG_ERR("No buffers in pool");
+        worker_buffers_put(worker);
+        return (-ENOMEM);
+    }
+    return (0);
+}
+
+static void worker_buffers_put(mqtt_worker_t *worker) {
+    struct mqtt_client *client = &worker->client;
+
+    if (NULL != client->rx_buf) {
+        k_heap_free(&BufferPool, client->rx_buf);
+        client->rx_buf = NULL;
+    }
+    if (NULL != client->tx_buf) {
+        k_heap_free(&BufferPool, client->tx_buf);
+        client->tx_buf = NULL;
+    }
+}
+
+static void keepalive_ping(mqtt_worker_t *worker, const char *reason) {
+    if (INT64_MAX != worker->ping_deadline) {
+        return; /* still waiting for PINGRESP */
+    }
+
+    int32_t res = mqtt_ping(&worker->client);
+    if (0 != res) {
+        LOG_ERR("mqtt_ping failed %d", res);
+        return;
+    }
+
+    LOG_INF("Ping, %s", reason);
+    worker->ping_deadline =
+        k_uptime_get() + MQTT_WORKER_PINGRESP_TIMEOUT * MSEC_PER_SEC;
+}
+
+/* Uptime when keepalive_process() has something to do */
+static int64_t keepalive_next(mqtt_worker_t *worker) {
+    if (INT64_MAX != worker->ping_deadline) {
+        return (worker->ping_deadline);
+    }
+
+    /* any received packet proves the link, so traffic postpones the ping */
+    int64_t next = worker->last_rx_ms + MQTT_WORKER_KEEPALIVE * MSEC_PER_SEC;
+
+    /* protocol keepalive, restarted by every sent packet */
+    int32_t left = mqtt_keepalive_time_left(&worker->client);
+    if (0 <= left) {
+        next = MIN(next, k_uptime_get() + left);
+    }
+
+    return (next);
+}
+
+static int32_t keepalive_process(mqtt_worker_t *worker) {
+    int64_t uptime_ms = k_uptime_get();
+
+    if (INT64_MAX != worker->ping_deadline) {
+        /* PINGRESP can not be read while a message is held */
+        if (uptime_ms >= worker->ping_deadline &&
+            NULL == atomic_ptr_get(&worker->rx_held)) {
+            LOG_WRN("PINGRESP timeout, dropping connection");
+            mqtt_abort(&worker->client);
+            worker->connected = false;
+            return (-ETIMEDOUT);
+        }
+        return (0);
+    }
+
+    if (0 == mqtt_keepalive_time_left(&worker->client)) {
+        keepalive_ping(worker, "keepalive");
+    } else if (worker->last_rx_ms + MQTT_WORKER_KEEPALIVE * MSEC_PER_SEC <=
+               uptime_ms) {
+        keepalive_ping(worker, "rx idle");
+    }
+
+    return (0);
+}
+
+/* Time until the nearest of keepalive, publish ack deadline, session flush
+ * or store drain */
+static int32_t input_timeout(mqtt_worker_t *worker) {
+    int64_t uptime_ms = k_uptime_get();
+    int64_t wakeup = keepalive_next(worker);
+
+    wakeup = MIN(wakeup, publish_slots_next_deadline(worker));
+    wakeup = MIN(wakeup, mqtt_session_flush_deadline(&worker->session));
+
+    if (0 < mqtt_store_count(&worker->store)) {
+        wakeup = MIN(wakeup, worker->next_store_drain);
+    }
+
+    if (INT64_MAX == wakeup) {
+        return (SYS_FOREVER_MS);
+    }
+
+    /* same uptime grid for all instances, timers due close together share
+     * one wakeup. Grid is not in phase with beacons, it only coalesces. Due
+     * timers are not delayed and PINGRESP deadline is never rounded, a dead
+     * link is detected on time. */
+    int64_t align = atomic_get(&WakeAlignMs);
+    if (0 < align && uptime_ms < wakeup) {
+        int64_t aligned = ((wakeup + align - 1) / align) * align;
+        wakeup = (INT64_MAX != worker->ping_deadline)
+                     ? MIN(aligned, worker->ping_deadline)
+                     : aligned;
+    }
+    return ((int32_t)MAX(wakeup - uptime_ms, 0));
 }
 
-static int32_t connect_to_broker(void) {
-    struct mqtt_client *client = &ClientCtx;
+static int32_t connect_to_broker(mqtt_worker_t *worker) {
+    struct mqtt_client *client = &worker->client;
     int32_t res = 0;
 
-    DisconnectReqExternal = false;
-    Connected = false;
+    worker->disconnect_req = false;
+    worker->connected = false;
+
+    res = worker_buffers_get(worker);
+    if (0 != res) {
+        goto failed_done;
+    }
+
+    /* includes TLS handshake, short when session was resumed */
+    int64_t connect_ms = k_uptime_get();
     res = mqtt_connect(client);
     if (res != 0) {
         LOG_ERR("mqtt_connect, err %d", res);
         mqtt_disconnect(client);
         goto failed_done;
     }
+    LOG_INF("Transport connected in %lld ms", k_uptime_get() - connect_ms);
 
-    res = wait_for_input(2000);
+    res = wait_for_input(worker, 2000, false);
     if (0 < res) {
         mqtt_input(client);
     }
 
-    if (!Connected) {
+    if (!worker->connected) {
         LOG_ERR("Connection timeout, abort...");
         mqtt_abort(client);
         res = -1;
@@ -342,34 +1846,43 @@ failed_done:
     return (res);
 }
 
-static int32_t input_handle(void) {
+static int32_t input_handle(mqtt_worker_t *worker) {
     int32_t res = 0;
-    struct mqtt_client *client = &ClientCtx;
-    static int64_t next_alive = INT64_MIN;
+    struct mqtt_client *client = &worker->client;
 
-    /* idle and process messages */
-    int64_t uptime_ms = k_uptime_get();
-    if (uptime_ms < next_alive) {
-        res = wait_for_input(1 * MSEC_PER_SEC);
+    session_resend_drain(worker);
+    publish_store_drain(worker);
+    publish_queue_process(worker);
+    if (k_uptime_get() >= mqtt_session_flush_deadline(&worker->session)) {
+        mqtt_session_flush(&worker->session);
+    }
+    if (0 < publish_slots_expire(worker)) {
+        /* missing ack may be the first sign of half-open connection */
+        keepalive_ping(worker, "publish ack timeout");
+    }
+
+    if (subs_held_retry(worker)) {
+        /* backpressure, socket is not read until dispatch makes room and
+         * TCP window closes towards the broker */
+        int32_t timeout = input_timeout(worker);
+        timeout = (0 > timeout) ? DISPATCH_RETRY : MIN(timeout, DISPATCH_RETRY);
+        wait_for_request(worker, K_MSEC(timeout));
+    } else {
+        /* idle until socket input, request from other thread or timer */
+        res = wait_for_input(worker, input_timeout(worker), true);
         if (0 < res) {
             mqtt_input(client);
         }
+    }
 
-        if (!Connected) {
-            res = -1;
-            goto failed_done;
-        }
+    if (!worker->connected) {
+        res = -1;
+        goto failed_done;
+    }
 
-        if (DisconnectReqExternal) {
-            mqtt_disconnect(client);
-            Connected = false;
-            res = -1;
-            goto failed_done;
-        }
-    } else {
-        LOG_INF("Keepalive...");
-        mqtt_live(client);
-        next_alive = uptime_ms + (60 * MSEC_PER_SEC);
+    res = keepalive_process(worker);
+    if (0 != res) {
+        goto failed_done;
     }
 
     res = 0; /* success done */
@@ -378,57 +1891,104 @@ failed_done:
     return (res);
 }
 
-static int32_t dns_resolve(void) {
-    static struct zsock_addrinfo hints;
+static int32_t dns_resolve(mqtt_worker_t *worker) {
+    struct zsock_addrinfo hints = {0};
     struct zsock_addrinfo *haddr;
     int32_t res = 0;
     uint8_t *in_addr = NULL;
 
-    memset(&Broker, 0, sizeof(struct sockaddr_storage));
-    struct sockaddr_in *ipv4_broker = (struct sockaddr_in *)&Broker;
+    memset(&worker->broker, 0, sizeof(struct sockaddr_storage));
+    struct sockaddr_in *ipv4_broker = (struct sockaddr_in *)&worker->broker;
 
     ipv4_broker->sin_family = AF_INET;
-    ipv4_broker->sin_port = htons(BrokerPort);
-    res = zsock_inet_pton(AF_INET, BrokerHostnameStr, &ipv4_broker->sin_addr);
+    ipv4_broker->sin_port = htons(worker->port);
+    res = zsock_inet_pton(AF_INET, worker->hostname, &ipv4_broker->sin_addr);
     if (0 != res) {
-        in_addr = ipv4_broker->sin_addr.s4_addr;
-        LOG_INF("Broker addr %d.%d.%d.%d", in_addr[0], in_addr[1], in_addr[2],
-                in_addr[3]);
         res = 0; /* 0 - success, string ip address delivered, dns not needed */
         goto resolve_done;
     }
 
+    res = dns_cache_next(&worker->dns, &ipv4_broker->sin_addr, false);
+    if (0 == res) {
+        LOG_INF("Broker addr from cache");
+        goto resolve_done;
+    }
+
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = 0;
 
-    res = net_getaddrinfo_addr_str(BrokerHostnameStr, BrokerPortStr, &hints,
+    res = net_getaddrinfo_addr_str(worker->hostname, worker->port_str, &hints,
                                    &haddr);
-    if (0 != res) {
+    if (0 == res) {
+        LOG_INF("Broker resolved, %d addresses",
+                dns_cache_update(&worker->dns, haddr));
+        zsock_freeaddrinfo(haddr);
+    } else {
         LOG_ERR("Unable to get address of broker, err %d", res);
-        goto resolve_done;
     }
 
-    ipv4_broker->sin_family = AF_INET;
-    ipv4_broker->sin_port = htons(BrokerPort);
-    net_ipaddr_copy(&ipv4_broker->sin_addr, &net_sin(haddr->ai_addr)->sin_addr);
-    in_addr = ipv4_broker->sin_addr.s4_addr;
-    LOG_INF("Broker addr %d.%d.%d.%d", in_addr[0], in_addr[1], in_addr[2],
-            in_addr[3]);
+    /* when lookup failed try last known addresses even if expired */
+    if (0 != dns_cache_next(&worker->dns, &ipv4_broker->sin_addr, 0 != res)) {
+        res = -ENOENT;
+        goto resolve_done;
+    }
+    res = 0;
 
 resolve_done:
+    if (0 == res) {
+        in_addr = ipv4_broker->sin_addr.s4_addr;
+        LOG_INF("Broker addr %d.%d.%d.%d", in_addr[0], in_addr[1], in_addr[2],
+                in_addr[3]);
+    }
     return (res);
 }
 
+/* Flow control and topic aliases negotiated for the new connection */
+static void connack_limits_set(mqtt_worker_t *worker,
+                               const struct mqtt_connack_param *connack) {
+    int32_t inflight_max = MQTT_WORKER_INFLIGHT_MAX;
+
+#if defined(CONFIG_MQTT_VERSION_5_0)
+    /* absent Receive Maximum means 65535, absent alias maximum means 0 */
+    if (connack->prop.rx.has_receive_maximum) {
+        inflight_max = MIN(inflight_max, connack->prop.receive_maximum);
+    }
+
+    worker->alias_cnt = 0;
+    worker->alias_max = 0;
+    if (connack->prop.rx.has_topic_alias_maximum) {
+        worker->alias_max = MIN(MQTT_WORKER_TOPIC_ALIASES,
+                                connack->prop.topic_alias_maximum);
+    }
+
+    LOG_INF("Receive maximum %d, topic aliases %d", inflight_max,
+            worker->alias_max);
+#endif
+
+    k_mutex_lock(&worker->slots_lock, K_FOREVER);
+    worker->inflight_max = MAX(inflight_max, 1);
+    k_mutex_unlock(&worker->slots_lock);
+}
+
 static void mqtt_evt_handler(struct mqtt_client *const client,
                              const struct mqtt_evt *evt) {
-    LOG_INF("mqtt_evt_handler");
-    LastEvt = evt->type;
+    mqtt_worker_t *worker = CONTAINER_OF(client, mqtt_worker_t, client);
+
+    /* Runs for every packet, so only DBG here. Disabled levels are removed
+     * at compile time, arguments are not even evaluated. */
+    LOG_DBG("mqtt_evt_handler %d", evt->type);
+    worker->last_evt = evt->type;
+
+    if (MQTT_EVT_DISCONNECT != evt->type) {
+        worker->last_rx_ms = k_uptime_get();
+    }
 
     switch (evt->type) {
         case MQTT_EVT_SUBACK: {
             LOG_INF("MQTT_EVT_SUBACK");
-            Subscribed = true;
+            worker->subscribed =
+                (worker->subscribe_id == evt->param.suback.message_id);
             break;
         }
         case MQTT_EVT_UNSUBACK: {
@@ -439,104 +1999,69 @@ static void mqtt_evt_handler(struct mqtt_client *const client,
             if (evt->result != 0) {
                 LOG_ERR("MQTT connect failed %d", evt->result);
             } else {
-                Connected = true;
+                worker->connected = true;
+                worker->ping_deadline = INT64_MAX;
+                LOG_INF("Session present %u",
+                        evt->param.connack.session_present_flag);
+                connack_limits_set(worker, &evt->param.connack);
             }
             break;
         }
         case MQTT_EVT_DISCONNECT: {
             LOG_INF("MQTT client disconnected %d", evt->result);
-            Connected = false;
+            worker->connected = false;
+            publish_slots_abort(worker, -ENOTCONN);
             break;
         }
         case MQTT_EVT_PUBLISH: {
-            LOG_INF("MQTT_EVT_PUBLISH");
-            subs_data_t *subs_data = NULL;
             const struct mqtt_publish_param *pub = &evt->param.publish;
-            int32_t len = pub->message.payload.len;
-            int32_t bytes_read = INT32_MIN;
-            bool cleanup_and_break = false;
-
-            LOG_INF("MQTT publish received %d, %d bytes", evt->result, len);
-            LOG_INF("   id: %d, qos: %d", pub->message_id,
-                    pub->message.topic.qos);
-            LOG_INF("   topic: %s", pub->message.topic.topic.utf8);
-
-            if (0 != k_mem_slab_alloc(&SubsQueueSlab, (void **)&subs_data,
-                                      K_MSEC(1000))) {
-                LOG_ERR("Get free subs slab failed");
-                cleanup_and_break = true;
-            }
 
-            if (MQTT_WORKER_MAX_PAYLOAD_LEN < (pub->message.payload.len + 1)) {
-                LOG_ERR("Payload to long %d", len);
-                cleanup_and_break = true;
-            }
-
-            if (MQTT_WORKER_MAX_TOPIC_LEN < pub->message.topic.topic.size) {
-                LOG_ERR("Topic to long %d", pub->message.topic.topic.size);
-                cleanup_and_break = true;
-            }
+            LOG_DBG("Publish received %d, id %d, qos %d, %d bytes",
+                    evt->result, pub->message_id, pub->message.topic.qos,
+                    pub->message.payload.len);
 
-            if (!Connected) {
+            int32_t res = -ENOTCONN;
+            if (!worker->connected) {
                 LOG_WRN("Not connected yet");
-                cleanup_and_break = true;
+                mqtt_stats_inc(&worker->stats, MQTT_STATS_DROPPED);
+                subs_payload_discard(client, pub->message.payload.len);
+            } else {
+                res = subs_receive(worker, pub);
             }
 
-            if (cleanup_and_break) {
-                uint8_t tmp[32];
-                if (NULL != subs_data) {
-                    k_mem_slab_free(&SubsQueueSlab, (void **)&subs_data);
-                }
-
-                while (len) { /* cleanup mqtt socket buffer */
-                    bytes_read = mqtt_read_publish_payload_blocking(
-                        client, tmp, len >= 32 ? 32 : len);
-                    if (0 > bytes_read) {
-                        break;
-                    }
-                    len -= bytes_read;
-                }
+            if (MQTT_QOS_1_AT_LEAST_ONCE != pub->message.topic.qos) {
                 break;
             }
-
-            /* assuming the config message is textual */
-            int32_t read_idx = 0;
-            while (len) {
-                bytes_read = mqtt_read_publish_payload_blocking(
-                    client, subs_data->payload + read_idx,
-                    len >= 32 ? 32 : len);
-
-                if (0 > bytes_read) {
-                    LOG_ERR("Failure to read payload");
-                    break;
-                }
-
-                len -= bytes_read;
-                read_idx += bytes_read;
-            }
-
-            subs_data->payload[pub->message.payload.len] = '\0';
-            subs_data->payload_len = pub->message.payload.len;
-            subs_data->topic_len = pub->message.topic.topic.size;
-            if (0 <= bytes_read) {
-                LOG_INF("   payload: %s", subs_data->payload);
-                memcpy(subs_data->topic, pub->message.topic.topic.utf8,
-                       subs_data->topic_len);
-                subs_data->topic[subs_data->topic_len] = '\0';
-                int32_t res = k_msgq_put(&SubsQueue, &subs_data, K_MSEC(1000));
-                if (0 != res) {
-                    LOG_ERR("Timeout to put subs msg into queue");
-                }
+            if (-EAGAIN == res) {
+                /* acked once queued, so the broker resends it when the held
+                 * message is dropped on disconnect */
+                worker->rx_held_ack = pub->message_id;
+            } else {
+                /* queued or dropped for good, must not come again */
+                subs_ack(worker, pub->message_id);
             }
-
             break;
         }
         case MQTT_EVT_PUBACK: {
-            if (evt->result != 0) {
-                LOG_ERR("PUBACK error %d", evt->result);
+            int32_t result = evt->result;
+#if defined(CONFIG_MQTT_VERSION_5_0)
+            /* reason codes below 0x80 are success, e.g. no subscribers */
+            if (0 == result && 0x80 <= evt->param.puback.reason_code) {
+                result = evt->param.puback.reason_code;
+            }
+#endif
+            if (result != 0) {
+                LOG_ERR("PUBACK error %d", result);
+                mqtt_stats_inc(&worker->stats, MQTT_STATS_NACKED);
             } else {
-                LOG_INF("PUBACK packet id: %u", evt->param.puback.message_id);
-                k_sem_give(&PublishAck);
+                LOG_DBG("PUBACK packet id: %u", evt->param.puback.message_id);
+                mqtt_stats_inc(&worker->stats, MQTT_STATS_ACKED);
+            }
+            uint16_t message_id = evt->param.puback.message_id;
+            bool tracked = mqtt_session_release(&worker->session, message_id);
+            if (!publish_slot_complete(worker, message_id, result) &&
+                !tracked) {
+                LOG_WRN("PUBACK for unknown packet id: %u", message_id);
             }
             break;
         }
@@ -554,6 +2079,7 @@ static void mqtt_evt_handler(struct mqtt_client *const client,
         }
         case MQTT_EVT_PINGRESP: {
             LOG_INF("MQTT_EVT_PINGRESP");
+            worker->ping_deadline = INT64_MAX;
             break;
         }
         default: {
@@ -565,4 +2091,4 @@ static void mqtt_evt_handler(struct mqtt_client *const client,
 
 /* ---------------------------------------------------------------------------
  * end of file
- * --------------------------------------------------------------------------*/
\ No newline at end of file
+ * --------------------------------------------------------------------------*/
@@ -0,0 +1,80 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: payload_cbor.c
+ * --------------------------------------------------------------------------*/
+#include "payload_cbor.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <zcbor_encode.h>
+
+int32_t payload_cbor_encode(const payload_field_t *fields, size_t cnt,
+                            uint8_t *buf, size_t size) {
+    bool ok = true;
+
+    /* one backup for the map container */
+    ZCBOR_STATE_E(state, 1, buf, size, 1);
+
+    ok = zcbor_map_start_encode(state, cnt);
+    for (size_t i = 0; ok && i < cnt; i++) {
+        const payload_field_t *field = &fields[i];
+
+        ok = zcbor_tstr_encode_ptr(state, field->key, strlen(field->key));
+        if (!ok) {
+            break;
+        }
+
+        switch (field->type) {
+            case PAYLOAD_FIELD_INT: {
+                ok = zcbor_int32_put(state, field->value.i);
+                break;
+            }
+            case PAYLOAD_FIELD_FLOAT: {
+                ok = zcbor_float32_put(state, field->value.f);
+                break;
+            }
+            case PAYLOAD_FIELD_BOOL: {
+                ok = zcbor_bool_put(state, field->value.b);
+                break;
+            }
+            case PAYLOAD_FIELD_STR: {
+                ok = zcbor_tstr_encode_ptr(state, field->value.s,
+                                           strlen(field->value.s));
+                break;
+            }
+            default: {
+                return (-EINVAL);
+            }
+        }
+    }
+
+    if (!ok || !zcbor_map_end_encode(state, cnt)) {
+        return (-EMSGSIZE);
+    }
+
+    return ((int32_t)(state->payload - buf));
+}
+
+int32_t payload_cbor_array_head(uint8_t *buf, uint16_t cnt) {
+    const uint8_t major = 0x80; /* major type 4, array */
+
+    if (24 > cnt) {
+        buf[0] = major | cnt;
+        return (1);
+    }
+    if (UINT8_MAX >= cnt) {
+        buf[0] = major | 24; /* 1 byte count follows */
+        buf[1] = cnt;
+        return (2);
+    }
+    buf[0] = major | 25; /* 2 byte count follows, big endian */
+    buf[1] = cnt >> 8;
+    buf[2] = cnt & 0xFF;
+    return (3);
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
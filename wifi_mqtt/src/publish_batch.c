@@ -0,0 +1,179 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: publish_batch.c
+ * --------------------------------------------------------------------------*/
+#include "publish_batch.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(BATCH, CONFIG_APP_PUBLISH_BATCH_LOG_LEVEL);
+
+/* Items are encoded behind room for the array head, which is known only
+ * when the batch is sent */
+#define BATCH_ITEMS_SIZE                                                       \
+    (MQTT_WORKER_MAX_PUBLISH_LEN - PAYLOAD_CBOR_ARRAY_HEAD_MAX)
+
+typedef struct batch_entry {
+    mqtt_worker_t *worker; /* NULL - entry free */
+    char topic[MQTT_WORKER_MAX_TOPIC_LEN + 1];
+    uint16_t count;
+    uint16_t len; /* encoded items */
+    int64_t deadline;
+    uint8_t buf[MQTT_WORKER_MAX_PUBLISH_LEN];
+} batch_entry_t;
+
+static batch_entry_t *batch_entry_get(mqtt_worker_t *worker,
+                                      const char *topic);
+static int32_t batch_send(batch_entry_t *entry);
+static void batch_flush_work(struct k_work *work);
+
+static batch_entry_t Batches[PUBLISH_BATCH_MAX_TOPICS];
+
+K_MUTEX_DEFINE(BatchLock);
+K_WORK_DELAYABLE_DEFINE(FlushWork, batch_flush_work);
+
+int32_t publish_batch_add(mqtt_worker_t *worker, const char *topic,
+                          const payload_field_t *fields, size_t cnt) {
+    int32_t res = 0;
+
+    k_mutex_lock(&BatchLock, K_FOREVER);
+    batch_entry_t *entry = batch_entry_get(worker, topic);
+    if (NULL == entry) {
+        LOG_ERR("No free batch for %s", topic);
+        res = -ENOMEM;
+        goto failed_done;
+    }
+
+    for (;;) {
+        uint8_t *item = entry->buf + PAYLOAD_CBOR_ARRAY_HEAD_MAX + entry->len;
+        res = payload_cbor_encode(fields, cnt, item,
+                                  BATCH_ITEMS_SIZE - entry->len);
+        if (-EMSGSIZE != res || 0 == entry->count) {
+            break;
+        }
+
+        /* batch is full, send it and start the next one with this item */
+        if (0 != batch_send(entry)) {
+            res = -ENOBUFS;
+            goto failed_done;
+        }
+    }
+
+    if (0 > res) {
+        LOG_ERR("Reading encode failed, err %d", res);
+        goto failed_done;
+    }
+
+    if (0 == entry->count) {
+        entry->deadline = k_uptime_get() + PUBLISH_BATCH_LATENCY;
+        /* keeps earlier schedule, older batches expire first */
+        k_work_schedule(&FlushWork, K_MSEC(PUBLISH_BATCH_LATENCY));
+    }
+    entry->count++;
+    entry->len += res;
+    res = 0;
+
+failed_done:
+    k_mutex_unlock(&BatchLock);
+    return (res);
+}
+
+void publish_batch_flush(void) {
+    k_mutex_lock(&BatchLock, K_FOREVER);
+    for (int32_t i = 0; i < PUBLISH_BATCH_MAX_TOPICS; i++) {
+        Batches[i].deadline = INT64_MIN;
+    }
+    k_mutex_unlock(&BatchLock);
+
+    k_work_reschedule(&FlushWork, K_NO_WAIT);
+}
+
+/* Must be called with BatchLock held */
+static batch_entry_t *batch_entry_get(mqtt_worker_t *worker,
+                                      const char *topic) {
+    batch_entry_t *free_entry = NULL;
+
+    if (MQTT_WORKER_MAX_TOPIC_LEN < strlen(topic)) {
+        return (NULL);
+    }
+
+    for (int32_t i = 0; i < PUBLISH_BATCH_MAX_TOPICS; i++) {
+        batch_entry_t *entry = &Batches[i];
+        if (NULL == entry->worker) {
+            free_entry = (NULL == free_entry) ? entry : free_entry;
+        } else if (worker == entry->worker &&
+                   0 == strcmp(topic, entry->topic)) {
+            return (entry);
+        }
+    }
+
+    if (NULL != free_entry) {
+        free_entry->worker = worker;
+        strcpy(free_entry->topic, topic);
+        free_entry->count = 0;
+        free_entry->len = 0;
+    }
+    return (free_entry);
+}
+
+/* Must be called with BatchLock held, entry stays assigned to its topic */
+static int32_t batch_send(batch_entry_t *entry) {
+    uint8_t head[PAYLOAD_CBOR_ARRAY_HEAD_MAX];
+
+    int32_t head_len = payload_cbor_array_head(head, entry->count);
+    uint8_t *payload = entry->buf + PAYLOAD_CBOR_ARRAY_HEAD_MAX - head_len;
+    memcpy(payload, head, head_len);
+
+    int32_t res = mqtt_worker_publish_async(entry->worker, entry->topic,
+                                            payload, head_len + entry->len,
+                                            NULL, NULL);
+    if (0 > res) {
+        LOG_WRN("Batch of %u not sent, err %d", entry->count, res);
+        return (res);
+    }
+
+    LOG_DBG("Batch of %u sent, %u bytes", entry->count, head_len + entry->len);
+    entry->count = 0;
+    entry->len = 0;
+    return (0);
+}
+
+static void batch_flush_work(struct k_work *work) {
+    int64_t next = INT64_MAX;
+
+    k_mutex_lock(&BatchLock, K_FOREVER);
+    int64_t uptime_ms = k_uptime_get();
+    for (int32_t i = 0; i < PUBLISH_BATCH_MAX_TOPICS; i++) {
+        batch_entry_t *entry = &Batches[i];
+        if (NULL == entry->worker) {
+            continue;
+        }
+
+        if (0 < entry->count && entry->deadline <= uptime_ms) {
+            if (0 != batch_send(entry)) {
+                /* publish slots busy, readings stay in the batch */
+                entry->deadline = uptime_ms + PUBLISH_BATCH_RETRY;
+            }
+        }
+
+        if (0 == entry->count) {
+            entry->worker = NULL;
+        } else {
+            next = MIN(next, entry->deadline);
+        }
+    }
+    k_mutex_unlock(&BatchLock);
+
+    if (INT64_MAX != next) {
+        k_work_schedule(&FlushWork, K_MSEC(MAX(next - uptime_ms, 0)));
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/
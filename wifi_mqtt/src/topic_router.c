@@ -0,0 +1,280 @@
+/* ---------------------------------------------------------------------------
+ *  mqtt
+ * ---------------------------------------------------------------------------
+ *  Name: topic_router.c
+ * --------------------------------------------------------------------------*/
+#include "topic_router.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zephyr/sys/util.h>
+
+#define NODE_NONE (-1)
+#define NODE_ROOT (0)
+
+static int32_t filter_check(const char *filter, const char *end);
+static int32_t filter_nodes_missing(const topic_router_t *router,
+                                    const char *filter, const char *end);
+static int16_t node_child_find(const topic_router_t *router, int16_t parent,
+                               const char *level, uint16_t len, uint32_t hash);
+static int16_t node_child_add(topic_router_t *router, int16_t parent,
+                              const char *level, uint16_t len, uint32_t hash);
+static bool node_is(const topic_router_node_t *node, char wildcard);
+static int32_t route_add(const topic_router_t *router, int16_t node,
+                         subs_cb_t *handlers, int32_t cnt, int32_t max,
+                         mqtt_worker_overflow_t *overflow);
+static int32_t match_level(const topic_router_t *router, int16_t parent,
+                           const char *level, const char *end,
+                           subs_cb_t *handlers, int32_t cnt, int32_t max,
+                           mqtt_worker_overflow_t *overflow);
+
+int32_t topic_router_add(topic_router_t *router, const char *filter,
+                         enum mqtt_qos qos, subs_cb_t cb,
+                         mqtt_worker_overflow_t overflow) {
+    uint16_t route = router->subs.list_count;
+    const char *level = filter;
+    const char *end = filter + strlen(filter);
+
+    if (TOPIC_ROUTER_MAX_FILTERS <= route) {
+        return (-ENOMEM);
+    }
+
+    /* whole filter is checked first, so a rejected one adds no nodes */
+    if (0 != filter_check(filter, end)) {
+        return (-EINVAL);
+    }
+
+    if (0 == router->node_cnt) { /* first use, create root */
+        router->nodes[NODE_ROOT].child = NODE_NONE;
+        router->nodes[NODE_ROOT].sibling = NODE_NONE;
+        router->nodes[NODE_ROOT].route = NODE_NONE;
+        router->node_cnt = 1;
+    }
+
+    if (TOPIC_ROUTER_MAX_NODES - router->node_cnt <
+        filter_nodes_missing(router, filter, end)) {
+        return (-ENOMEM);
+    }
+
+    int16_t node = NODE_ROOT;
+    for (;;) {
+        const char *sep = memchr(level, '/', end - level);
+        const char *level_end = (NULL != sep) ? sep : end;
+        uint16_t len = level_end - level;
+
+        uint32_t hash = topic_router_hash(level, len);
+        int16_t child = node_child_find(router, node, level, len, hash);
+        if (NODE_NONE == child) {
+            child = node_child_add(router, node, level, len, hash);
+        }
+        node = child;
+
+        if (NULL == sep) {
+            break;
+        }
+        level = sep + 1;
+    }
+
+    if (NODE_NONE != router->nodes[node].route) {
+        return (-EEXIST);
+    }
+
+    router->nodes[node].route = route;
+    router->handlers[route] = cb;
+    router->overflow[route] = overflow;
+    router->topics[route].topic.utf8 = (const uint8_t *)filter;
+    router->topics[route].topic.size = end - filter;
+    router->topics[route].qos = qos;
+    router->subs.list = router->topics;
+    router->subs.list_count = route + 1;
+
+    return (0);
+}
+
+int32_t topic_router_match(const topic_router_t *router, const char *topic,
+                           uint16_t topic_len, subs_cb_t *handlers,
+                           int32_t max, mqtt_worker_overflow_t *overflow) {
+    if (0 == router->node_cnt) {
+        return (0);
+    }
+
+    return (match_level(router, NODE_ROOT, topic, topic + topic_len, handlers,
+                        0, max, overflow));
+}
+
+struct mqtt_subscription_list *topic_router_subs_list(topic_router_t *router) {
+    return (0 < router->subs.list_count ? &router->subs : NULL);
+}
+
+uint32_t topic_router_hash(const char *str, uint16_t len) {
+    uint32_t hash = 2166136261U; /* FNV-1a */
+
+    for (uint16_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619U;
+    }
+    return (hash);
+}
+
+static int32_t filter_check(const char *filter, const char *end) {
+    const char *level = filter;
+
+    if (filter == end) {
+        return (-EINVAL);
+    }
+
+    for (;;) {
+        const char *sep = memchr(level, '/', end - level);
+        uint16_t len = ((NULL != sep) ? sep : end) - level;
+
+        /* wildcard must fill whole level, '#' only as the last one */
+        if (NULL != memchr(level, '+', len) && 1 != len) {
+            return (-EINVAL);
+        }
+        if (NULL != memchr(level, '#', len) && (1 != len || NULL != sep)) {
+            return (-EINVAL);
+        }
+
+        if (NULL == sep) {
+            break;
+        }
+        level = sep + 1;
+    }
+
+    return (0);
+}
+
+/* Number of nodes topic_router_add() creates for the filter */
+static int32_t filter_nodes_missing(const topic_router_t *router,
+                                    const char *filter, const char *end) {
+    const char *level = filter;
+    int16_t node = NODE_ROOT;
+    int32_t missing = 0;
+
+    for (;;) {
+        const char *sep = memchr(level, '/', end - level);
+        uint16_t len = ((NULL != sep) ? sep : end) - level;
+
+        if (NODE_NONE != node) {
+            node = node_child_find(router, node, level, len,
+                                   topic_router_hash(level, len));
+        }
+        if (NODE_NONE == node) { /* every deeper level is new too */
+            missing++;
+        }
+
+        if (NULL == sep) {
+            break;
+        }
+        level = sep + 1;
+    }
+
+    return (missing);
+}
+
+static int16_t node_child_find(const topic_router_t *router, int16_t parent,
+                               const char *level, uint16_t len, uint32_t hash) {
+    int16_t child = router->nodes[parent].child;
+
+    while (NODE_NONE != child) {
+        const topic_router_node_t *node = &router->nodes[child];
+        if (hash == node->hash && len == node->level_len &&
+            0 == memcmp(level, node->level, len)) {
+            break;
+        }
+        child = node->sibling;
+    }
+    return (child);
+}
+
+static int16_t node_child_add(topic_router_t *router, int16_t parent,
+                              const char *level, uint16_t len, uint32_t hash) {
+    if (TOPIC_ROUTER_MAX_NODES <= router->node_cnt) {
+        return (NODE_NONE);
+    }
+
+    int16_t idx = router->node_cnt++;
+    topic_router_node_t *node = &router->nodes[idx];
+
+    node->level = level;
+    node->level_len = len;
+    node->hash = hash;
+    node->child = NODE_NONE;
+    node->route = NODE_NONE;
+    node->sibling = router->nodes[parent].child;
+    router->nodes[parent].child = idx;
+
+    return (idx);
+}
+
+static bool node_is(const topic_router_node_t *node, char wildcard) {
+    return (1 == node->level_len && wildcard == node->level[0]);
+}
+
+static int32_t route_add(const topic_router_t *router, int16_t node,
+                         subs_cb_t *handlers, int32_t cnt, int32_t max,
+                         mqtt_worker_overflow_t *overflow) {
+    int16_t route = router->nodes[node].route;
+
+    if (NODE_NONE != route && cnt < max) {
+        handlers[cnt++] = router->handlers[route];
+        *overflow = MAX(*overflow, router->overflow[route]);
+    }
+    return (cnt);
+}
+
+static int32_t match_level(const topic_router_t *router, int16_t parent,
+                           const char *level, const char *end,
+                           subs_cb_t *handlers, int32_t cnt, int32_t max,
+                           mqtt_worker_overflow_t *overflow) {
+    const char *sep = memchr(level, '/', end - level);
+    uint16_t len = ((NULL != sep) ? sep : end) - level;
+    uint32_t hash = topic_router_hash(level, len);
+
+    /* topics like $SYS are not matched by wildcards at the first level */
+    bool wildcards = !(NODE_ROOT == parent && 0 < len && '$' == level[0]);
+
+    for (int16_t child = router->nodes[parent].child; NODE_NONE != child;
+         child = router->nodes[child].sibling) {
+        const topic_router_node_t *node = &router->nodes[child];
+
+        if (node_is(node, '#')) {
+            if (wildcards) {
+                cnt = route_add(router, child, handlers, cnt, max, overflow);
+            }
+            continue;
+        }
+
+        if (node_is(node, '+')) {
+            if (!wildcards) {
+                continue;
+            }
+        } else if (hash != node->hash || len != node->level_len ||
+                   0 != memcmp(level, node->level, len)) {
+            continue;
+        }
+
+        if (NULL != sep) {
+            cnt = match_level(router, child, sep + 1, end, handlers, cnt, max,
+                              overflow);
+            continue;
+        }
+
+        /* last topic level, "a/#" matches "a" as well */
+        cnt = route_add(router, child, handlers, cnt, max, overflow);
+        for (int16_t sub = node->child; NODE_NONE != sub;
+             sub = router->nodes[sub].sibling) {
+            if (node_is(&router->nodes[sub], '#')) {
+                cnt = route_add(router, sub, handlers, cnt, max, overflow);
+            }
+        }
+    }
+
+    return (cnt);
+}
+
+/* ---------------------------------------------------------------------------
+ * end of file
+ * --------------------------------------------------------------------------*/